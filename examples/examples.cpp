@@ -4,6 +4,8 @@
 #include <fmt/time.h>
 #include <streams/ostream.hpp>
 #include <streams/istream.hpp>
+#include <streams/ranges.hpp>
+#include <streams/pipeline.hpp>
 
 struct Student {
     std::string name;
@@ -13,11 +15,13 @@ struct Student {
 
 void write_student_binary(streams::ostream& out, const Student& student)
 {
-    out.put(student.name.size());
-    out.write(gsl::as_bytes(gsl::span<const char>(
+    //Stage the fields and send them down as one write.
+    streams::batch_writer<> batch(out);
+    batch.put(student.name.size());
+    batch.write(gsl::as_bytes(gsl::span<const char>(
                     student.name.data(), student.name.size())));
-    out.put(student.id);
-    out.put(student.gpa);
+    batch.put(student.id);
+    batch.put(student.gpa);
 }
 
 streams::optional<Student> read_student_binary(streams::istream& in)
@@ -41,6 +45,20 @@ void write_student_text(streams::ostream& out, const Student& student)
             student.name, student.id, student.gpa);
 }
 
+Student parse_student_text(streams::string_view line)
+{
+    static const std::regex rx(R"|("([^"]+)",([0-9]+),([0-9.]+))|");
+    std::cmatch match;
+    if (!std::regex_match(line.begin(), line.end(), match, rx)) {
+        throw std::string("Format mismatch!");
+    }
+    Student student;
+    student.name = match[1];
+    student.id = std::stoi(match[2]);
+    student.gpa = std::stof(match[3]);
+    return student;
+}
+
 streams::optional<Student> read_student_text(streams::istream& in)
 {
     //What to do about "formatted input"?
@@ -55,16 +73,7 @@ streams::optional<Student> read_student_text(streams::istream& in)
     
     auto line = streams::get_line(in);
     if (!line) return streams::nullopt;
-    std::regex rx(R"|("([^"]+)",([0-9]+),([0-9.]+))|");
-    std::smatch match;
-    if (!std::regex_match(*line, match, rx)) {
-        throw std::string("Format mismatch!");
-    }
-    Student student;
-    student.name = match[1];
-    student.id = std::stoi(match[2]);
-    student.gpa = std::stof(match[3]);
-    return student;
+    return parse_student_text(*line);
 }
 
 void print_student_header()
@@ -112,10 +121,8 @@ int main()
                 });
         streams::span_istream in(out.vector());
         std::vector<Student> roll2;
-        while (true) {
-            auto student = read_student_text(in);
-            if (!student) break;
-            roll2.push_back(*student);
+        for (auto line: streams::lines(in)) {
+            roll2.push_back(parse_student_text(line));
         }
         print_student_header();
         std::for_each(roll2.begin(), roll2.end(), print_student);
@@ -145,6 +152,15 @@ int main()
         streams::put_line(out, "This is a test. This is only a test.");
     }
 
+    //The same filter, run on worker threads:
+    {
+        auto shout = [](gsl::span<const gsl::byte> in, streams::ostream& out) {
+            for (auto b: in) out.put(static_cast<char>(::toupper(int(b))));
+        };
+        streams::parallel_ostream out(streams::stdouts, shout);
+        streams::put_line(out, "This is a test. This is only a test.");
+    }
+
     //Line-based filter ostream:
     {
         struct Line_number_ostream: public streams::ostream {
@@ -157,9 +173,9 @@ int main()
                 if (0 == _line) {
                     //If this is the first time we're called,
                     //write the header for the first line.
-                    streams::vector_ostream vos;
-                    streams::print(vos, "{}: ", ++_line);
-                    written += _sink.write(vos.vector());
+                    streams::small_ostream<16> sos;
+                    streams::print(sos, "{}: ", ++_line);
+                    written += _sink.write(sos.view());
                 }
                 do {
                     auto nl = std::find(data.begin(), data.end(),
@@ -174,9 +190,9 @@ int main()
                     auto count = std::distance(data.begin(), nl + 1);
                     written += _sink.write(data.first(count));
                     //...write the line header...
-                    streams::vector_ostream vos;
-                    streams::print(vos, "{}: ", ++_line);
-                    written += _sink.write(vos.vector());
+                    streams::small_ostream<16> sos;
+                    streams::print(sos, "{}: ", ++_line);
+                    written += _sink.write(sos.view());
                     //...and most to past the newline.
                     data = data.subspan(count);
                 } while (data.size() > 0);
@@ -0,0 +1,308 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+
+namespace streams {
+    //fd_copier
+    //The strategies behind copy(). Each one copies a byte range and reports
+    //whether the kernel let it, so the caller can fall back to the next.
+    class fd_copier {
+    public:
+        fd_copier(int in, int out): _in(in), _out(out) {}
+
+        fd_copier(const fd_copier&) = delete;
+        fd_copier& operator=(const fd_copier&) = delete;
+
+        ~fd_copier()
+        {
+            if (-1 != _pipe[0]) close(_pipe[0]);
+            if (-1 != _pipe[1]) close(_pipe[1]);
+        }
+
+        std::ptrdiff_t copy()
+        {
+            struct stat in_info;
+            struct stat out_info;
+            if (-1 == fstat(_in, &in_info) || -1 == fstat(_out, &out_info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (!S_ISREG(in_info.st_mode) || !S_ISREG(out_info.st_mode)) {
+                return copy_stream();
+            }
+
+            auto in_start = seek(_in, 0, SEEK_CUR);
+            auto out_start = seek(_out, 0, SEEK_CUR);
+            auto size = in_info.st_size - in_start;
+            if (size <= 0) return 0;
+
+            //A clone shares the source's extents, holes and all, so the copy
+            //costs only metadata. It replaces the whole destination, so it
+            //only fits a whole source going into an empty file.
+            if (0 == in_start && 0 == out_start && 0 == out_info.st_size &&
+                    clone()) {
+                seek(_in, in_info.st_size, SEEK_SET);
+                seek(_out, in_info.st_size, SEEK_SET);
+                return size;
+            }
+
+            //Holes are skipped, not written, which only leaves holes in the
+            //output if nothing's there yet.
+            bool sparse = out_info.st_size <= out_start;
+            off_t pos = in_start;
+            while (pos < in_info.st_size) {
+                off_t data = pos;
+                off_t hole = in_info.st_size;
+                if (sparse) {
+                    data = lseek(_in, pos, SEEK_DATA);
+                    //ENXIO: Nothing but a hole left.
+                    if (-1 == data && ENXIO == errno) break;
+                    //SEEK_DATA not supported: It's all data.
+                    if (-1 == data) data = pos;
+                    hole = lseek(_in, data, SEEK_HOLE);
+                    if (-1 == hole) hole = in_info.st_size;
+                    hole = std::min<off_t>(hole, in_info.st_size);
+                }
+                copy_range(data, out_start + (data - in_start), hole - data);
+                pos = hole;
+            }
+
+            //A trailing hole still has to count toward the size.
+            auto out_end = out_start + size;
+            if (-1 == fstat(_out, &out_info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (out_info.st_size < out_end && -1 == ftruncate(_out, out_end)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            seek(_in, in_info.st_size, SEEK_SET);
+            seek(_out, out_end, SEEK_SET);
+            return size;
+        }
+
+    private:
+        static off_t seek(int fd, off_t offset, int whence)
+        {
+            auto loc = lseek(fd, offset, whence);
+            if (-1 == loc) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return loc;
+        }
+
+        //Errors that mean "this way of copying doesn't work here".
+        static bool unsupported(int error)
+        {
+            return EXDEV == error || EINVAL == error || ENOSYS == error ||
+                EOPNOTSUPP == error || ENOTTY == error || EBADF == error ||
+                EPERM == error;
+        }
+
+        bool clone()
+        {
+#ifdef FICLONE
+            if (0 == ioctl(_out, FICLONE, _in)) return true;
+            if (!unsupported(errno)) {
+                throw std::system_error(errno, std::system_category());
+            }
+#endif
+            return false;
+        }
+
+        void copy_range(off_t in_offset, off_t out_offset, off_t length)
+        {
+            while (length > 0) {
+                auto n = copy_file_range_once(in_offset, out_offset, length);
+                if (-1 == n) n = splice_once(in_offset, out_offset, length);
+                if (-1 == n) n = buffered_once(in_offset, out_offset, length);
+                //The source got shorter.
+                if (0 == n) break;
+                in_offset += n;
+                out_offset += n;
+                length -= n;
+            }
+        }
+
+        //The following return -1 if the method isn't supported.
+
+        ssize_t copy_file_range_once(
+                off_t in_offset, off_t out_offset, off_t length)
+        {
+            if (!_copy_file_range) return -1;
+            loff_t in_off = in_offset;
+            loff_t out_off = out_offset;
+            auto n = copy_file_range(_in, &in_off, _out, &out_off,
+                    length, 0);
+            if (-1 == n && unsupported(errno)) _copy_file_range = false;
+            else if (-1 == n) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return n;
+        }
+
+        //File to file through a pipe, without copying into user space.
+        ssize_t splice_once(off_t in_offset, off_t out_offset, off_t length)
+        {
+            if (!_splice) return -1;
+            if (-1 == _pipe[0] && -1 == pipe2(_pipe, O_CLOEXEC)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            loff_t in_off = in_offset;
+            auto n = splice(_in, &in_off, _pipe[1], nullptr,
+                    std::min(length, off_t(pipe_size)), SPLICE_F_MOVE);
+            if (-1 == n && unsupported(errno)) {
+                _splice = false;
+                return -1;
+            }
+            if (-1 == n) {
+                throw std::system_error(errno, std::system_category());
+            }
+            loff_t out_off = out_offset;
+            for (auto left = n; left > 0;) {
+                auto m = splice(_pipe[0], nullptr, _out, &out_off, left,
+                        SPLICE_F_MOVE);
+                //The output won't take a splice (O_APPEND, say). What's in
+                //the pipe has already left the input, so write it from here.
+                if (-1 == m && unsupported(errno)) {
+                    _splice = false;
+                    drain_pipe(out_off, left);
+                    break;
+                }
+                if (-1 == m) {
+                    throw std::system_error(errno, std::system_category(),
+                            "splice() to offset " + std::to_string(out_off));
+                }
+                left -= m;
+            }
+            return n;
+        }
+
+        void drain_pipe(off_t out_offset, ssize_t length)
+        {
+            _buffer.resize(buffer_size);
+            while (length > 0) {
+                auto n = ::read(_pipe[0], _buffer.data(),
+                        std::min(length, ssize_t(buffer_size)));
+                if (-1 == n) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                write_buffer(n, out_offset);
+                out_offset += n;
+                length -= n;
+            }
+        }
+
+        ssize_t buffered_once(off_t in_offset, off_t out_offset, off_t length)
+        {
+            _buffer.resize(buffer_size);
+            auto n = pread(_in, _buffer.data(),
+                    std::min(length, off_t(buffer_size)), in_offset);
+            if (-1 == n) {
+                throw std::system_error(errno, std::system_category());
+            }
+            write_buffer(n, out_offset);
+            return n;
+        }
+
+        //pwrite() the first n bytes of the buffer.
+        void write_buffer(ssize_t n, off_t out_offset)
+        {
+            for (ssize_t written = 0; written < n;) {
+                auto m = pwrite(_out, _buffer.data() + written, n - written,
+                        out_offset + written);
+                if (-1 == m) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                written += m;
+            }
+        }
+
+        //For pipes, sockets, and the like: splice() if either end is a
+        //pipe, otherwise read() and write().
+        std::ptrdiff_t copy_stream()
+        {
+            std::ptrdiff_t total = 0;
+            while (_splice) {
+                auto n = splice(_in, nullptr, _out, nullptr, pipe_size,
+                        SPLICE_F_MOVE);
+                if (-1 == n && unsupported(errno)) _splice = false;
+                else if (-1 == n) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                else if (0 == n) return total;
+                else total += n;
+            }
+            _buffer.resize(buffer_size);
+            while (true) {
+                auto n = ::read(_in, _buffer.data(), _buffer.size());
+                if (-1 == n) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                if (0 == n) return total;
+                for (ssize_t written = 0; written < n;) {
+                    auto m = ::write(_out, _buffer.data() + written,
+                            n - written);
+                    if (-1 == m) {
+                        throw std::system_error(errno, std::system_category());
+                    }
+                    written += m;
+                }
+                total += n;
+            }
+        }
+
+        static constexpr std::ptrdiff_t pipe_size = 64 * 1024;
+        static constexpr std::ptrdiff_t buffer_size = 1024 * 1024;
+
+        int _in;
+        int _out;
+        int _pipe[2] = { -1, -1 };
+        bool _copy_file_range = true;
+        bool _splice = true;
+        std::vector<gsl::byte> _buffer;
+    };
+
+    //copy
+    //Copy everything from an istream's current position to its end into an
+    //ostream, using the cheapest method the kernel allows:
+    //
+    //  1. FICLONE, which shares extents and copies only metadata (a whole
+    //     file going into an empty one, on a filesystem with reflinks).
+    //  2. copy_file_range() for each data extent found with SEEK_DATA and
+    //     SEEK_HOLE, so holes stay holes. Some filesystems reflink here too.
+    //  3. splice() through a pipe, which skips the copy into user space.
+    //  4. Plain reads and writes.
+    //
+    //Pipes and other non-files use splice() or plain reads and writes. A
+    //pipe or socket whose reader has gone throws EPIPE instead of raising
+    //SIGPIPE.
+    //Returns the number of bytes copied, holes included.
+    template<typename I, typename O>
+    std::ptrdiff_t copy(posix_base_istream<I>& in, posix_base_ostream<O>& out)
+    {
+        sigpipe_guard guard;
+        fd_copier copier(in.fd(), out.fd());
+        return copier.copy();
+    }
+
+    //copy_file
+    //Copy a file, preserving holes and reflinking where possible.
+    std::ptrdiff_t copy_file(const std::string& from, const std::string& to)
+    {
+        posix_file_istream in(from);
+        posix_file_ostream out(to);
+        return copy(in, out);
+    }
+}
@@ -0,0 +1,415 @@
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <gsl/gsl>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+#include "mmapstream.hpp"
+
+namespace streams {
+    ////////////////////////////////////////////////////////////////////////////
+    // file istreams
+    ////////////////////////////////////////////////////////////////////////////
+
+    //posix_direct_istream
+    //Reads a file with O_DIRECT, bypassing the page cache.
+    //
+    //Meant for huge files that are scanned once, where caching the data would
+    //only evict more useful pages. If the filesystem doesn't support O_DIRECT,
+    //it falls back to plain read() calls with POSIX_FADV_NOREUSE.
+    //
+    //The block size must be a multiple of the alignment O_DIRECT requires.
+    class posix_direct_istream: public istream {
+    public:
+        static constexpr std::ptrdiff_t alignment = 4096;
+
+        explicit posix_direct_istream(
+                const std::string& path, std::ptrdiff_t block_size = 1 << 20):
+            _block_size(block_size)
+        {
+            Expects(block_size > 0 && 0 == block_size % alignment);
+
+            void* p = nullptr;
+            auto result = posix_memalign(&p, alignment, block_size);
+            if (0 != result) {
+                throw std::system_error(result, std::system_category());
+            }
+            _buffer.reset(static_cast<gsl::byte*>(p));
+
+#ifdef O_DIRECT
+            _fd.reset(open(path.c_str(), O_RDONLY | O_DIRECT));
+            _direct = (-1 != _fd.get());
+            if (!_direct && EINVAL != errno) {
+                throw std::system_error(errno, std::system_category());
+            }
+#endif
+            if (-1 == _fd.get()) {
+                _fd.reset(open(path.c_str(), O_RDONLY));
+                if (-1 == _fd.get()) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                posix_fadvise(_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+                posix_fadvise(_fd.get(), 0, 0, POSIX_FADV_NOREUSE);
+            }
+        }
+
+        //Whether the file was actually opened with O_DIRECT.
+        bool direct() const { return _direct; }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        {
+            auto original_span = s;
+            std::ptrdiff_t bytes_delivered = 0;
+            while (s.size() > 0) {
+                if (_available.size() <= 0) {
+                    if (_eof) break;
+                    fill();
+                    if (_available.size() <= 0) break;
+                }
+                auto to_copy = std::min(s.size(), _available.size());
+                std::copy_n(_available.begin(), to_copy, s.begin());
+                _available = _available.subspan(to_copy);
+                s = s.subspan(to_copy);
+                bytes_delivered += to_copy;
+            }
+            return original_span.first(bytes_delivered);
+        }
+
+        void fill()
+        {
+            ssize_t bytes_read;
+            do {
+                bytes_read = ::read(_fd.get(), _buffer.get(), _block_size);
+            } while (-1 == bytes_read && EINTR == errno);
+            if (-1 == bytes_read) {
+                throw std::system_error(errno, std::system_category());
+            }
+            //O_DIRECT reads have to start on an aligned offset, so once we
+            //get a short read we can't ask again.
+            if (bytes_read < _block_size) _eof = true;
+            _available = gsl::span<gsl::byte>(_buffer.get(), bytes_read);
+        }
+
+        struct Free {
+            void operator()(gsl::byte* p) { std::free(p); }
+        };
+
+        unique_fd _fd;
+        std::ptrdiff_t _block_size;
+        std::unique_ptr<gsl::byte, Free> _buffer;
+        gsl::span<gsl::byte> _available;
+        bool _direct = false;
+        bool _eof = false;
+    };
+
+    //file_access
+    //How file_istream reads a file.
+    enum class file_access {
+        automatic,  //Let file_istream pick one of the below.
+        buffered,   //Large read() calls through a buffer.
+        mmap,       //Map the file with mmap_istream.
+        direct      //Bypass the page cache with posix_direct_istream.
+    };
+
+    //file_istream
+    //The default file istream.
+    //
+    //Stats the file and picks how to read it:
+    //  * Pipes, FIFOs, and files that report a size of zero (like those in
+    //    /proc) can't be mapped, so they get buffered reads.
+    //  * Small files also get buffered reads. Mapping them costs more than
+    //    copying them.
+    //  * Mid-size regular files get mapped.
+    //  * Huge regular files are assumed to be one-pass scans and get direct
+    //    I/O, so they don't flush the page cache.
+    //Pass anything other than file_access::automatic to override the choice.
+    class file_istream: public istream {
+    public:
+        static constexpr std::ptrdiff_t mmap_threshold = 64 * 1024;
+        static constexpr std::ptrdiff_t direct_threshold =
+            std::ptrdiff_t(4) * 1024 * 1024 * 1024;
+        static constexpr std::ptrdiff_t buffer_size = 128 * 1024;
+
+        explicit file_istream(
+                const std::string& path,
+                file_access access = file_access::automatic):
+            _access((file_access::automatic == access)? choose(path): access)
+        {
+            switch (_access) {
+            case file_access::mmap:
+                _stream.reset(new mmap_istream(path));
+                break;
+            case file_access::direct:
+                _stream.reset(new posix_direct_istream(path));
+                break;
+            default:
+                _file.reset(new posix_file_istream(path));
+                _stream.reset(new buf_istream(*_file, buffer_size));
+                break;
+            }
+        }
+
+        //The access method that was actually used.
+        file_access access() const { return _access; }
+
+        //The access method file_access::automatic would use for this path.
+        static file_access choose(const std::string& path)
+        {
+            struct stat info;
+            if (-1 == stat(path.c_str(), &info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (!S_ISREG(info.st_mode)) return file_access::buffered;
+            if (info.st_size < mmap_threshold) return file_access::buffered;
+            if (info.st_size < direct_threshold) return file_access::mmap;
+            return file_access::direct;
+        }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        { return _stream->read(s); }
+
+        file_access _access;
+        std::unique_ptr<posix_file_istream> _file;
+        std::unique_ptr<istream> _stream;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    // file ostreams
+    ////////////////////////////////////////////////////////////////////////////
+
+    //file_ostream
+    //The default file ostream.
+    //
+    //Buffers output in front of a POSIX file descriptor. When a write doesn't
+    //fit in the buffer, the buffered bytes and the new data go to the kernel
+    //together in a single writev() instead of being copied through the buffer.
+    //
+    //flush() hands the data to the kernel but doesn't wait for the disk.
+    //Call sync() when the data has to be durable, or turn on durable_flush()
+    //to make every flush() do that.
+    class file_ostream: public ostream, public seekable {
+    public:
+        static constexpr std::ptrdiff_t default_buffer_size = 64 * 1024;
+
+        explicit file_ostream(
+                const std::string& path,
+                bool append = false,
+                std::ptrdiff_t buffer_size = default_buffer_size):
+            _fd(open_for_output(path, append))
+        {
+            Expects(buffer_size > 0);
+            _buffer.resize(buffer_size);
+        }
+
+        ~file_ostream()
+        {
+            no_throw_flush();
+            close(_fd);
+        }
+
+        int fd() { return _fd; }
+
+        //Reserve disk space for the next bytes to be written, without
+        //changing the size of the file. This is only a hint; it does nothing
+        //where the filesystem can't preallocate.
+        void preallocate(std::ptrdiff_t bytes)
+        {
+            Expects(bytes >= 0);
+#ifdef FALLOC_FL_KEEP_SIZE
+            auto result = fallocate(_fd, FALLOC_FL_KEEP_SIZE, _tell(), bytes);
+            if (-1 == result && EOPNOTSUPP != errno && ENOSYS != errno) {
+                throw std::system_error(errno, std::system_category());
+            }
+#endif
+        }
+
+        //Write out the buffer and wait for the data to reach the disk.
+        void sync()
+        {
+            write_buffer();
+            if (-1 == fdatasync(_fd)) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        //Whether flush() should also sync().
+        void durable_flush(bool durable) { _durable = durable; }
+
+    private:
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            if (bytes.size() <= free_space().size()) {
+                std::copy(bytes.begin(), bytes.end(), free_space().begin());
+                _used += bytes.size();
+            } else {
+                write_all(used(), bytes);
+                _used = 0;
+            }
+            return bytes.size();
+        }
+
+        void _flush() override
+        {
+            if (_durable) sync();
+            else write_buffer();
+        }
+
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            if (n > std::ptrdiff_t(_buffer.size())) return {};
+            if (n > free_space().size()) write_buffer();
+            return free_space().first(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            Expects(n <= free_space().size());
+            _used += n;
+        }
+
+        void _seek(std::ptrdiff_t offset, seek_origin origin) override
+        {
+            write_buffer();
+            int o = (seek_origin::set == origin)? SEEK_SET:
+                (seek_origin::cur == origin)? SEEK_CUR:
+                SEEK_END;
+            if (-1 == lseek(_fd, offset, o)) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        std::ptrdiff_t _tell() override
+        {
+            auto loc = lseek(_fd, 0, SEEK_CUR);
+            if (-1 == loc) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return loc + _used;
+        }
+
+        //The first _used bytes of the buffer are output. Reserved space
+        //after them isn't, until it's committed.
+        gsl::span<const gsl::byte> used()
+        { return gsl::span<const gsl::byte>(_buffer).first(_used); }
+
+        gsl::span<gsl::byte> free_space()
+        { return gsl::span<gsl::byte>(_buffer).subspan(_used); }
+
+        void write_buffer()
+        {
+            if (0 == _used) return;
+            write_all(used(), {});
+            _used = 0;
+        }
+
+        //Needed for flushing from dtor.
+        void no_throw_flush() noexcept
+        {
+            try { write_buffer(); }
+            catch (...) {}
+        }
+
+        //Write both spans with as few writev() calls as the kernel allows.
+        void write_all(
+                gsl::span<const gsl::byte> first,
+                gsl::span<const gsl::byte> second)
+        {
+            iovec iov[2] = {
+                { const_cast<gsl::byte*>(first.data()),
+                    static_cast<size_t>(first.size()) },
+                { const_cast<gsl::byte*>(second.data()),
+                    static_cast<size_t>(second.size()) }
+            };
+            iovec* next = iov;
+            int count = 2;
+            while (count > 0) {
+                auto bytes_written = ::writev(_fd, next, count);
+                if (-1 == bytes_written) {
+                    if (EINTR == errno) continue;
+                    throw std::system_error(errno, std::system_category());
+                }
+                size_t n = bytes_written;
+                while (count > 0 && n >= next->iov_len) {
+                    n -= next->iov_len;
+                    ++next;
+                    --count;
+                }
+                if (count > 0) {
+                    next->iov_base = static_cast<char*>(next->iov_base) + n;
+                    next->iov_len -= n;
+                }
+            }
+        }
+
+        int _fd;
+        std::vector<gsl::byte> _buffer;
+        std::ptrdiff_t _used = 0;
+        bool _durable = false;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////
+    // whole-file input
+    ////////////////////////////////////////////////////////////////////////////
+
+    //read_all
+    //Read everything that's left in an istream.
+    //
+    //The buffer starts at size_hint (or 64 KiB) and doubles whenever it
+    //fills, so reading n bytes costs O(log n) reallocations and read() calls.
+    std::vector<gsl::byte> read_all(istream& in, std::ptrdiff_t size_hint = 0)
+    {
+        Expects(size_hint >= 0);
+        //Leave room for one byte past the hint, so the read that finds the
+        //end doesn't have to grow the buffer.
+        std::vector<gsl::byte> buffer(
+                std::max<std::ptrdiff_t>(size_hint + 1, 64 * 1024));
+        std::ptrdiff_t used = 0;
+        while (true) {
+            auto unused = gsl::span<gsl::byte>(buffer).subspan(used);
+            used += in.read(unused).size();
+            if (used < static_cast<std::ptrdiff_t>(buffer.size())) break;
+            buffer.resize(buffer.size() * 2);
+        }
+        buffer.resize(used);
+        return buffer;
+    }
+
+    //read_all
+    //Read a whole file into memory.
+    //
+    //For regular files, the buffer is sized from fstat() and filled with a
+    //single large read(), so it's allocated exactly once. Anything else
+    //(pipes, FIFOs, /proc files that report a size of zero) goes through the
+    //growing buffer of read_all(istream&).
+    //
+    //To look at a file without copying it at all, use mapped_file instead.
+    std::vector<gsl::byte> read_all(const std::string& path)
+    {
+        posix_file_istream in(path);
+        struct stat info;
+        if (-1 == fstat(in.fd(), &info)) {
+            throw std::system_error(errno, std::system_category());
+        }
+        if (!S_ISREG(info.st_mode) || 0 == info.st_size) return read_all(in);
+
+        posix_fadvise(in.fd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<gsl::byte> buffer(info.st_size);
+        auto bytes = in.read(buffer);
+        //The file may have shrunk since the fstat().
+        buffer.resize(bytes.size());
+        return buffer;
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <gsl/gsl>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+
+namespace streams {
+    //follow_istream
+    //Like `tail -F`: at the end of the file, wait for more to be written.
+    //
+    //Waits on inotify instead of polling, so appended bytes are picked up as
+    //soon as they're written. If the file is truncated, reading starts over
+    //at the top. If the file is rotated (renamed or deleted, with a new file
+    //created at the path), the old file is drained and then the new one is
+    //opened.
+    //
+    //read() returns as soon as any bytes are available, which may be fewer
+    //than were asked for. With a timeout (in milliseconds), read() returns an
+    //empty span if nothing happens to the file in time; the stream can be
+    //read again. Activity on other files in its directory doesn't count.
+    //
+    //Linux only.
+    class follow_istream: public istream {
+    public:
+        explicit follow_istream(const std::string& path, int timeout = -1):
+            _path(path),
+            _timeout(timeout),
+            _inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+        {
+            if (-1 == _inotify.get()) {
+                throw std::system_error(errno, std::system_category());
+            }
+            //Watching the directory tells us when a rotated file reappears.
+            auto slash = path.rfind('/');
+            auto dir = (std::string::npos == slash)? std::string("."):
+                (0 == slash)? std::string("/"): path.substr(0, slash);
+            _name = path.substr(std::string::npos == slash? 0: slash + 1);
+            if (-1 == inotify_add_watch(_inotify.get(), dir.c_str(),
+                        IN_CREATE | IN_MOVED_TO)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            open_file();
+        }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        {
+            while (true) {
+                auto bytes = _file->read(s);
+                if (bytes.size() > 0) return bytes;
+                if (truncated()) {
+                    _file->seek(0, seekable::seek_origin::set);
+                } else if (rotated()) {
+                    open_file();
+                } else if (!wait()) {
+                    return bytes;
+                }
+            }
+        }
+
+        void open_file()
+        {
+            if (-1 != _watch) inotify_rm_watch(_inotify.get(), _watch);
+            _file.reset(new posix_file_istream(_path));
+            _watch = inotify_add_watch(_inotify.get(), _path.c_str(),
+                    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            if (-1 == _watch) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        bool truncated()
+        {
+            struct stat info;
+            if (-1 == fstat(_file->fd(), &info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return info.st_size < _file->tell();
+        }
+
+        //Is there a different file at the path than the one we have open?
+        bool rotated()
+        {
+            struct stat current;
+            struct stat opened;
+            //Nothing there yet. Keep waiting.
+            if (-1 == stat(_path.c_str(), &current)) return false;
+            if (-1 == fstat(_file->fd(), &opened)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return current.st_dev != opened.st_dev ||
+                current.st_ino != opened.st_ino;
+        }
+
+        //Block until inotify reports something about our file.
+        //Returns false on timeout.
+        bool wait()
+        {
+            using clock = std::chrono::steady_clock;
+            auto deadline = clock::now() + std::chrono::milliseconds(_timeout);
+            while (true) {
+                int timeout = _timeout;
+                if (_timeout > 0) {
+                    auto left = std::chrono::duration_cast<
+                        std::chrono::milliseconds>(deadline - clock::now());
+                    timeout = std::max<int>(0, left.count());
+                }
+                pollfd p{ _inotify.get(), POLLIN, 0 };
+                auto result = poll(&p, 1, timeout);
+                if (-1 == result && EINTR == errno) continue;
+                if (-1 == result) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                if (0 == result) return false;
+                if (read_events()) return true;
+            }
+        }
+
+        //Drain the events. Were any about the file, rather than something
+        //else in its directory?
+        bool read_events()
+        {
+            alignas(inotify_event) char buffer[4096];
+            bool ours = false;
+            while (true) {
+                auto bytes_read = ::read(_inotify.get(), buffer, sizeof buffer);
+                if (-1 == bytes_read && EINTR == errno) continue;
+                if (-1 == bytes_read && EAGAIN == errno) return ours;
+                if (-1 == bytes_read) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                for (auto p = buffer; p < buffer + bytes_read;) {
+                    auto event = reinterpret_cast<inotify_event*>(p);
+                    if (event->wd == _watch ||
+                            (event->len > 0 && _name == event->name)) {
+                        ours = true;
+                    }
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+
+        std::string _path;
+        //The file's name within its directory.
+        std::string _name;
+        int _timeout;
+        unique_fd _inotify;
+        int _watch = -1;
+        std::unique_ptr<posix_file_istream> _file;
+    };
+}
@@ -0,0 +1,126 @@
+#pragma once
+//Needs C++20 coroutines. Elsewhere, this header is empty.
+#if defined(__cpp_impl_coroutine)
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include <gsl/gsl>
+
+#include "istream.hpp"
+
+namespace streams {
+    //byte_generator
+    //The return type for a coroutine that produces bytes by co_yielding
+    //spans of them:
+    //
+    //  streams::byte_generator numbers(int n)
+    //  {
+    //      for (int i = 0; i < n; ++i) {
+    //          auto line = std::to_string(i) + '\n';
+    //          co_yield gsl::as_bytes(gsl::span<const char>(line));
+    //      }
+    //  }
+    //
+    //A yielded span only has to stay valid until the coroutine resumes, so
+    //it can point at the coroutine's own locals.
+    class byte_generator {
+    public:
+        struct promise_type {
+            gsl::span<const gsl::byte> current;
+            std::exception_ptr exception;
+
+            byte_generator get_return_object()
+            { return byte_generator(handle::from_promise(*this)); }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+
+            std::suspend_always yield_value(
+                    gsl::span<const gsl::byte> bytes) noexcept
+            {
+                current = bytes;
+                return {};
+            }
+
+            void return_void() {}
+            void unhandled_exception()
+            { exception = std::current_exception(); }
+        };
+
+        using handle = std::coroutine_handle<promise_type>;
+
+        byte_generator(byte_generator&& other) noexcept:
+            _h(std::exchange(other._h, {})) {}
+
+        byte_generator& operator=(byte_generator&& other) noexcept
+        {
+            std::swap(_h, other._h);
+            return *this;
+        }
+
+        ~byte_generator() { if (_h) _h.destroy(); }
+
+        //Run the coroutine to its next co_yield and return what it yielded,
+        //or an empty span once it's finished. Rethrows its exceptions.
+        gsl::span<const gsl::byte> next()
+        {
+            while (_h && !_h.done()) {
+                _h.resume();
+                auto& p = _h.promise();
+                if (p.exception) std::rethrow_exception(p.exception);
+                if (_h.done()) break;
+                auto bytes = std::exchange(p.current, {});
+                if (bytes.size() > 0) return bytes;
+            }
+            return {};
+        }
+
+    private:
+        explicit byte_generator(handle h): _h(h) {}
+
+        handle _h;
+    };
+
+    //generator_istream
+    //Read what a byte_generator yields. There's no thread or queue in
+    //between: when read() runs out of yielded bytes, it resumes the
+    //coroutine on the calling thread.
+    //
+    //next() hands out the yielded spans themselves, for callers that can
+    //use them in place instead of copying them out with read().
+    class generator_istream: public istream {
+    public:
+        explicit generator_istream(byte_generator g): _g(std::move(g)) {}
+
+        //The rest of the most recently yielded span, or the next one.
+        //Empty at the end. Valid until the next call to next() or read().
+        gsl::span<const gsl::byte> next()
+        {
+            if (_pending.size() <= 0) _pending = _g.next();
+            return std::exchange(_pending, {});
+        }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        {
+            std::ptrdiff_t filled = 0;
+            while (filled < s.size()) {
+                if (_pending.size() <= 0) {
+                    _pending = _g.next();
+                    if (_pending.size() <= 0) break;
+                }
+                auto n = std::min(s.size() - filled, _pending.size());
+                std::copy_n(_pending.begin(), n, s.begin() + filled);
+                _pending = _pending.subspan(n);
+                filled += n;
+            }
+            return s.first(filled);
+        }
+
+        byte_generator _g;
+        gsl::span<const gsl::byte> _pending;
+    };
+}
+#endif
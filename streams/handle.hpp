@@ -0,0 +1,110 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <gsl/gsl>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+
+namespace streams {
+    //stream_handle
+    //Holds any movable ostream (or istream) by value, inside the handle, so
+    //a table of streams of different types needs no heap allocation and no
+    //unique_ptr indirection:
+    //
+    //  std::vector<streams::ostream_handle<>> outs;
+    //  outs.emplace_back(streams::posix_file_ostream("log.txt"));
+    //  outs.emplace_back(streams::vector_ostream());
+    //  for (auto& out: outs) streams::put_line(*out, "hello");
+    //
+    //The stream must fit in Size bytes; that's checked at compile time.
+    //Streams that own threads, mappings, or buffers pointing into other
+    //streams aren't movable, and can't be held.
+    template<typename Stream, std::size_t Size>
+    class stream_handle {
+    public:
+        stream_handle() {}
+
+        template<typename T, typename = std::enable_if_t<
+            std::is_base_of<Stream, std::decay_t<T>>::value>>
+        stream_handle(T&& t)
+        { emplace<std::decay_t<T>>(std::forward<T>(t)); }
+
+        stream_handle(stream_handle&& other) noexcept { take(other); }
+
+        stream_handle& operator=(stream_handle&& other) noexcept
+        {
+            if (this != &other) {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+
+        stream_handle(const stream_handle&) = delete;
+        stream_handle& operator=(const stream_handle&) = delete;
+
+        ~stream_handle() { reset(); }
+
+        //Construct a T in place, replacing any stream already held.
+        template<typename T, typename... Args>
+        T& emplace(Args&&... args)
+        {
+            static_assert(std::is_base_of<Stream, T>::value,
+                    "stream_handle can only hold streams of its type.");
+            static_assert(sizeof(T) <= Size,
+                    "Stream is too big for this stream_handle's Size.");
+            static_assert(alignof(T) <= alignof(std::max_align_t),
+                    "Stream is over-aligned for stream_handle.");
+            static_assert(std::is_nothrow_move_constructible<T>::value,
+                    "stream_handle needs streams that can move.");
+            reset();
+            auto t = new (&_storage) T(std::forward<Args>(args)...);
+            _stream = t;
+            _move = &move_to<T>;
+            return *t;
+        }
+
+        //Destroy the stream, leaving the handle empty.
+        void reset()
+        {
+            if (!_stream) return;
+            _stream->~Stream();
+            _stream = nullptr;
+            _move = nullptr;
+        }
+
+        Stream* get() const { return _stream; }
+        Stream& operator*() const { return *_stream; }
+        Stream* operator->() const { return _stream; }
+        explicit operator bool() const { return nullptr != _stream; }
+
+    private:
+        //Move the T at from into storage, returning its Stream part.
+        template<typename T>
+        static Stream* move_to(Stream* from, void* storage)
+        { return new (storage) T(std::move(static_cast<T&>(*from))); }
+
+        void take(stream_handle& other)
+        {
+            if (!other._stream) return;
+            _stream = other._move(other._stream, &_storage);
+            _move = other._move;
+            other.reset();
+        }
+
+        std::aligned_storage_t<Size, alignof(std::max_align_t)> _storage;
+        //Not always the start of _storage, if the stream has several bases.
+        Stream* _stream = nullptr;
+        Stream* (*_move)(Stream*, void*) = nullptr;
+    };
+
+    template<std::size_t Size = 64>
+    using ostream_handle = stream_handle<ostream, Size>;
+
+    template<std::size_t Size = 64>
+    using istream_handle = stream_handle<istream, Size>;
+}
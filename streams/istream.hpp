@@ -1,6 +1,18 @@
 #pragma once
 #include <algorithm>
+#include <cstdio>
 #include <experimental/optional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
 #include "streams_common.hpp"
 
 namespace streams {
@@ -16,9 +28,7 @@ namespace streams {
     public:
         istream() {}
         istream(const istream&) = delete;
-        istream(istream&&) = delete;
         istream& operator=(const istream&) = delete;
-        istream& operator=(istream&&) = delete;
         virtual ~istream() {}
 
         //Tries to fill the span with bytes.
@@ -26,6 +36,24 @@ namespace streams {
         gsl::span<gsl::byte> read(gsl::span<gsl::byte> s)
         { return _read(s); }
 
+        //Tries to fill each span in turn, as if read() were called on each.
+        //Returns the total number of bytes read.
+        //
+        //  Header h;
+        //  in.read_scatter({
+        //          gsl::as_writeable_bytes(gsl::span<Header>(&h, 1)),
+        //          payload });
+        std::ptrdiff_t read_scatter(
+                gsl::span<const gsl::span<gsl::byte>> spans)
+        { return _read_scatter(spans); }
+
+        std::ptrdiff_t read_scatter(
+                std::initializer_list<gsl::span<gsl::byte>> spans)
+        {
+            return _read_scatter({ spans.begin(),
+                    static_cast<std::ptrdiff_t>(spans.size()) });
+        }
+
         //Read binary/unformatted data in host endianess.
         template<typename T>
         optional<T> get()
@@ -65,8 +93,28 @@ namespace streams {
             }
         }
 
+    protected:
+        //Only subclasses can move, so an istream& can't be sliced. Those that
+        //hold nothing but values are movable without further ado.
+        istream(istream&&) = default;
+        istream& operator=(istream&&) = default;
+
     private:
         virtual gsl::span<gsl::byte> _read(gsl::span<gsl::byte>) = 0;
+
+        //Override this if the stream can fill several spans more cheaply
+        //than with a _read() for each.
+        virtual std::ptrdiff_t _read_scatter(
+                gsl::span<const gsl::span<gsl::byte>> spans)
+        {
+            std::ptrdiff_t total = 0;
+            for (auto s: spans) {
+                auto bytes = _read(s);
+                total += bytes.size();
+                if (bytes.size() < s.size()) break;
+            }
+            return total;
+        }
     };
 
     class buf_istream: public istream {
@@ -79,12 +127,12 @@ namespace streams {
         gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
         {
             auto original_span = s;
-            if (_eof) return s.first(0);
             std::ptrdiff_t bytes_delivered = 0;
             //While the caller still wants bytes...
             while (s.size() > 0) {
                 //If the buffer is empty, fill it.
                 if (_available.size() <= 0) {
+                    if (_eof) break;
                     _available = _buffer;
                     _available = _source.read(_available);
                     if (_available.size() < _buffer.size()) {
@@ -98,21 +146,100 @@ namespace streams {
                 _available = _available.subspan(to_copy);
                 s = s.subspan(to_copy);
                 bytes_delivered += to_copy;
-                if (_eof) break;
             }
             return original_span.first(bytes_delivered);
         }
 
+        //Serve what we can from the buffer. Then read the rest straight into
+        //the caller's spans, with the buffer tacked on the end so the same
+        //call down the chain refills it.
+        std::ptrdiff_t _read_scatter(
+                gsl::span<const gsl::span<gsl::byte>> spans) override
+        {
+            std::ptrdiff_t total = 0;
+            std::ptrdiff_t i = 0;
+            gsl::span<gsl::byte> partial;
+            for (; i < spans.size(); ++i) {
+                auto s = spans[i];
+                auto to_copy = std::min(s.size(), _available.size());
+                std::copy_n(_available.begin(), to_copy, s.begin());
+                _available = _available.subspan(to_copy);
+                total += to_copy;
+                if (to_copy < s.size()) {
+                    partial = s.subspan(to_copy);
+                    break;
+                }
+            }
+            if (i == spans.size() || _eof) return total;
+
+            _scatter.assign(1, partial);
+            _scatter.insert(_scatter.end(), spans.begin() + i + 1, spans.end());
+            std::ptrdiff_t wanted = 0;
+            for (auto s: _scatter) wanted += s.size();
+            _scatter.push_back(_buffer);
+            auto bytes_read = _source.read_scatter(_scatter);
+            if (bytes_read < wanted + static_cast<std::ptrdiff_t>(
+                        _buffer.size())) {
+                _eof = true;
+            }
+            if (bytes_read <= wanted) return total + bytes_read;
+            _available = gsl::span<gsl::byte>(_buffer).first(
+                    bytes_read - wanted);
+            return total + wanted;
+        }
+
         istream& _source;
         std::vector<gsl::byte> _buffer;
         gsl::span<gsl::byte> _available;
         bool _eof = false;
+        std::vector<gsl::span<gsl::byte>> _scatter;
     };
 
     class span_istream: public istream {
     public:
         explicit span_istream(gsl::span<const gsl::byte> s): _available(s) {}
 
+        //The unread bytes, all at once, for callers that can use them in
+        //place. They count as read.
+        gsl::span<const gsl::byte> next()
+        { return std::exchange(_available, {}); }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        {
+            auto nbytes = std::min(s.size(), _available.size());
+            std::copy_n(_available.begin(), nbytes, s.begin());
+            _available = _available.subspan(nbytes);
+            return s.first(nbytes);
+        }
+
+        gsl::span<const gsl::byte> _available;
+    };
+
+    //vector_istream
+    //Read input from a vector<byte> that the stream owns.
+    class vector_istream: public istream {
+    public:
+        explicit vector_istream(std::vector<gsl::byte> v):
+            _v(std::move(v)), _available(_v) {}
+
+        //The bytes stay put when the vector moves, and so can _available.
+        vector_istream(vector_istream&& other) noexcept:
+            istream(std::move(other)),
+            _v(std::move(other._v)),
+            _available(other._available)
+        { other._available = {}; }
+
+        vector_istream& operator=(vector_istream&& other) noexcept
+        {
+            _v = std::move(other._v);
+            _available = other._available;
+            other._available = {};
+            return *this;
+        }
+
+        std::vector<gsl::byte>& vector() { return _v; }
+
     private:
         gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
         {
@@ -122,6 +249,7 @@ namespace streams {
             return s.first(nbytes);
         }
 
+        std::vector<gsl::byte> _v;
         gsl::span<const gsl::byte> _available;
     };
 
@@ -280,6 +408,51 @@ namespace streams {
             }
             return original_span.first(total_read);
         }
+
+        //readv() as many spans at a time as fit in a small iovec array.
+        std::ptrdiff_t _read_scatter(
+                gsl::span<const gsl::span<gsl::byte>> spans) override
+        {
+            std::ptrdiff_t total = 0;
+            while (spans.size() > 0) {
+                iovec iov[16];
+                int count = std::min<std::ptrdiff_t>(spans.size(), 16);
+                for (int i = 0; i < count; ++i) {
+                    iov[i].iov_base = spans[i].data();
+                    iov[i].iov_len = spans[i].size();
+                }
+                spans = spans.subspan(count);
+                iovec* next = iov;
+                while (true) {
+                    //Skip what's been filled (and any empty spans).
+                    while (count > 0 && 0 == next->iov_len) {
+                        ++next;
+                        --count;
+                    }
+                    if (0 == count) break;
+                    auto bytes_read = ::readv(fd(), next, count);
+                    if (-1 == bytes_read) {
+                        if (EINTR == errno) continue;
+                        throw std::system_error(errno, std::system_category());
+                    }
+                    if (0 == bytes_read) return total;
+                    total += bytes_read;
+                    size_t n = bytes_read;
+                    while (n > 0) {
+                        auto step = std::min(n, next->iov_len);
+                        auto base = static_cast<char*>(next->iov_base);
+                        next->iov_base = base + step;
+                        next->iov_len -= step;
+                        n -= step;
+                        if (0 == next->iov_len) {
+                            ++next;
+                            --count;
+                        }
+                    }
+                }
+            }
+            return total;
+        }
     };
 
     class posix_fd_istream: public posix_base_istream<posix_fd_istream> {
@@ -303,9 +476,19 @@ namespace streams {
             }
         }
 
+        posix_file_istream(posix_file_istream&& other) noexcept:
+            _fd(other._fd)
+        { other._fd = -1; }
+
+        posix_file_istream& operator=(posix_file_istream&& other) noexcept
+        {
+            std::swap(_fd, other._fd);
+            return *this;
+        }
+
         int fd() { return _fd; }
 
-        ~posix_file_istream() { close(_fd); }
+        ~posix_file_istream() { if (-1 != _fd) close(_fd); }
 
     private:
         int _fd;
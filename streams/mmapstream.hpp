@@ -1,29 +1,49 @@
+#pragma once
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include "istream.hpp"
+#include "ostream.hpp"
 
 namespace streams {
-    //Notes for mmap_ostream:
-    //O_WRONLY is not sufficient for mmap when writing? Must use O_RDWR?
-    //Need to seek to the size you want to write and write a zero there
-    //to make the file actually that size? Then mmap it.
-    //Extend the file by some fixed amount and then shrink-to-fit when close?
-    //Maybe provide a user API to "reserve" like a vector?
-    //Would need to unmap on flush?
-    //ftruncate()
-    //Resize = sync, unmap, "truncate", remap
+    //mmap_options
+    //Ways for mmap_istream to avoid taking a page fault on every new page.
+    struct mmap_options {
+        //Fault the whole file in when it's mapped (MAP_POPULATE).
+        bool populate = false;
+        //Ask for transparent huge pages (MADV_HUGEPAGE).
+        bool huge_pages = false;
+        //Keep madvise(MADV_WILLNEED) this many bytes ahead of the reader, so
+        //readahead is already under way when it gets there.
+        std::ptrdiff_t willneed_window = 0;
+        //Touch each page this many bytes ahead of the reader on a background
+        //thread, so the reader doesn't take the faults itself.
+        std::ptrdiff_t prefault_distance = 0;
+    };
 
     //TODO: Handling for large files.
     //TODO: Make seekable.
     class mmap_istream: public istream {
     public:
-        explicit mmap_istream(const std::string& path)
+        explicit mmap_istream(
+                const std::string& path,
+                const mmap_options& options = mmap_options()):
+            _options(options)
         {
+            Expects(options.willneed_window >= 0);
+            Expects(options.prefault_distance >= 0);
+
             auto fd = open(path.c_str(), O_RDONLY);
             if (-1 == fd) {
                 throw std::system_error(errno, std::system_category());
             }
-            _fd._fd = fd;
+            _fd.reset(fd);
 
             struct stat info;
             auto result = fstat(fd, &info);
@@ -32,41 +52,334 @@ namespace streams {
             }
             auto length = info.st_size;
 
-            auto p = mmap(nullptr, length, PROT_READ,
-                    MAP_FILE | MAP_PRIVATE, fd, 0);
+            int flags = MAP_FILE | MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            if (options.populate) flags |= MAP_POPULATE;
+#endif
+            auto p = mmap(nullptr, length, PROT_READ, flags, fd, 0);
             if (MAP_FAILED == p) {
                 throw std::system_error(errno, std::system_category());
             }
 
-            _mmap.set(reinterpret_cast<gsl::byte*>(p), length);
+            _mmap.reset(p, length);
+
+#ifdef MADV_HUGEPAGE
+            //Only a hint. Not every filesystem can back a file with huge
+            //pages.
+            if (options.huge_pages) madvise(p, length, MADV_HUGEPAGE);
+#endif
+            advise_ahead();
+            if (options.prefault_distance > 0) {
+                _prefaulter = std::thread([this]() { prefault(); });
+            }
+        }
+
+        ~mmap_istream()
+        {
+            if (_prefaulter.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _stop = true;
+                }
+                _wake.notify_one();
+                _prefaulter.join();
+            }
         }
 
     private:
         gsl::span<gsl::byte> _read(gsl::span<gsl::byte> bytes) override
         {
-            ptrdiff_t bytes_left = _mmap._s - _pos;
+            ptrdiff_t bytes_left = _mmap.size() - _pos;
             auto length = std::min(bytes_left, bytes.size());
-            std::copy_n(_mmap._p + _pos, length, bytes.data());
+            std::copy_n(_mmap.data() + _pos, length, bytes.data());
             _pos += length;
+            if (_options.willneed_window > 0) advise_ahead();
+            if (_prefaulter.joinable()) {
+                _cursor = _pos;
+                if (_parked) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _wake.notify_one();
+                }
+            }
             return bytes.first(length);
         }
 
-        struct Fd {
-            int _fd;
-            explicit Fd(int fd = -1): _fd(fd) {}
-            ~Fd() { if (-1 != _fd) close(_fd); }
-        };
+        //Once the reader is halfway through the advised window, advise the
+        //next one. madvise() needs a page-aligned start, so each window
+        //ends on a page boundary (or at the end of the file).
+        void advise_ahead()
+        {
+            auto window = _options.willneed_window;
+            if (window <= 0 || _pos + window / 2 < _advised) return;
+            std::ptrdiff_t size = _mmap.size();
+            auto end = std::min(round_up(_advised + window), size);
+            if (end <= _advised) return;
+            if (-1 == madvise(_mmap.data() + _advised, end - _advised,
+                        MADV_WILLNEED)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            _advised = end;
+        }
+
+        static std::ptrdiff_t page_size()
+        {
+            static const std::ptrdiff_t size = sysconf(_SC_PAGESIZE);
+            return size;
+        }
+
+        static std::ptrdiff_t round_up(std::ptrdiff_t n)
+        { return (n + page_size() - 1) / page_size() * page_size(); }
 
-        struct Mmap {
-            gsl::byte* _p = nullptr;
-            size_t _s = 0;
-            void set(gsl::byte* p, size_t s) { _p = p; _s = s; };
-            ~Mmap() { if (_p) munmap(_p, _s); }
-        };
+        //Runs on _prefaulter. Reads a byte from each page up to
+        //prefault_distance past the reader, then sleeps until the reader is
+        //halfway there.
+        void prefault()
+        {
+            auto page = page_size();
+            auto distance = _options.prefault_distance;
+            std::ptrdiff_t size = _mmap.size();
+            std::ptrdiff_t touched = 0;
+            volatile unsigned char sink = 0;
+            while (touched < size) {
+                auto limit = std::min(size, _cursor + distance);
+                for (; touched < limit; touched += page) {
+                    sink = sink +
+                        static_cast<unsigned char>(_mmap.data()[touched]);
+                }
+                if (touched >= size) return;
+                std::unique_lock<std::mutex> lock(_mutex);
+                _parked = true;
+                _wake.wait(lock, [&]() {
+                        return _stop || _cursor + distance / 2 >= touched;
+                    });
+                _parked = false;
+                if (_stop) return;
+            }
+        }
 
-        Fd _fd;
-        Mmap _mmap;
+        unique_fd _fd;
+        unique_mmap _mmap;
         ptrdiff_t _pos = 0;
+        mmap_options _options;
+        std::ptrdiff_t _advised = 0;
+
+        //Shared with _prefaulter.
+        std::atomic<std::ptrdiff_t> _cursor{0};
+        std::atomic<bool> _parked{false};
+        bool _stop = false;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::thread _prefaulter;
     };
-}
 
+    //mmap_ostream
+    //Writes a file through a shared memory mapping.
+    //
+    //The file is grown (and remapped) in doubling steps as output arrives,
+    //then cut back to the bytes actually written when the stream is
+    //destroyed.
+    //
+    //flush() waits for everything written since the last flush() to reach
+    //the disk. To keep that from being one huge stall, give a writeback
+    //window: each time that many more bytes have been written, writeback of
+    //them is started in the background, and the kernel waits for the window
+    //before it. That bounds the dirty pages to about two windows. Use
+    //sync_range() for finer control.
+    class mmap_ostream: public ostream {
+    public:
+        enum class sync_mode { async, sync };
+
+        explicit mmap_ostream(
+                const std::string& path, std::ptrdiff_t writeback_window = 0):
+            _fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)),
+            _window(round_up(writeback_window))
+        {
+            Expects(writeback_window >= 0);
+            if (-1 == _fd.get()) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        ~mmap_ostream()
+        {
+            _mmap.reset();
+            ftruncate(_fd.get(), _size);
+        }
+
+        //Write back part of the file.
+        //sync_mode::async starts writeback and returns.
+        //sync_mode::sync waits for it to reach the disk.
+        void sync_range(
+                std::ptrdiff_t offset,
+                std::ptrdiff_t length,
+                sync_mode mode = sync_mode::sync)
+        {
+            Expects(offset >= 0 && length >= 0);
+            auto end = std::min(offset + length, _size);
+            offset = offset - offset % page_size();
+            if (offset >= end) return;
+            if (sync_mode::sync == mode) {
+                if (-1 == msync(_mmap.data() + offset, end - offset, MS_SYNC)) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                return;
+            }
+#ifdef SYNC_FILE_RANGE_WRITE
+            //MS_ASYNC doesn't start any I/O on Linux; this does.
+            auto result = sync_file_range(_fd.get(), offset, end - offset,
+                    SYNC_FILE_RANGE_WRITE);
+#else
+            auto result = msync(_mmap.data() + offset, end - offset, MS_ASYNC);
+#endif
+            if (-1 == result) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        //Bytes written so far.
+        std::ptrdiff_t size() const { return _size; }
+
+    private:
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            grow(_size + bytes.size());
+            std::memcpy(_mmap.data() + _size, bytes.data(), bytes.size());
+            _size += bytes.size();
+            if (_window > 0) write_back();
+            return bytes.size();
+        }
+
+        //The space comes straight out of the mapping.
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            grow(_size + n);
+            return gsl::span<gsl::byte>(_mmap.data() + _size, n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            Expects(_size + n <= std::ptrdiff_t(_mmap.size()));
+            _size += n;
+            if (_window > 0) write_back();
+        }
+
+        void _flush() override
+        {
+            sync_range(_synced, _size - _synced);
+            _synced = _size - _size % page_size();
+        }
+
+        //Start writeback for each full window, then wait for the one before
+        //it. Waiting a window behind keeps the disk busy without letting
+        //dirty pages pile up.
+        void write_back()
+        {
+            while (_size - _written_back >= _window) {
+                sync_range(_written_back, _window, sync_mode::async);
+#ifdef SYNC_FILE_RANGE_WRITE
+                if (_written_back >= _window) {
+                    auto result = sync_file_range(_fd.get(),
+                            _written_back - _window, _window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+                    if (-1 == result) {
+                        throw std::system_error(errno, std::system_category());
+                    }
+                }
+#endif
+                _written_back += _window;
+            }
+        }
+
+        //Make room for at least `size` bytes, doubling the file each time.
+        void grow(std::ptrdiff_t size)
+        {
+            std::ptrdiff_t mapped = _mmap.size();
+            if (size <= mapped) return;
+            auto capacity = round_up(std::max<std::ptrdiff_t>(
+                        size, std::max<std::ptrdiff_t>(mapped * 2, 1 << 20)));
+            if (-1 == ftruncate(_fd.get(), capacity)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            void* p;
+#ifdef MREMAP_MAYMOVE
+            if (_mmap.data()) {
+                p = mremap(_mmap.data(), mapped, capacity, MREMAP_MAYMOVE);
+            } else
+#endif
+            {
+                _mmap.reset();
+                p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                        MAP_FILE | MAP_SHARED, _fd.get(), 0);
+            }
+            if (MAP_FAILED == p) {
+                throw std::system_error(errno, std::system_category());
+            }
+            _mmap.release();
+            _mmap.reset(p, capacity);
+        }
+
+        static std::ptrdiff_t page_size()
+        {
+            static const std::ptrdiff_t size = sysconf(_SC_PAGESIZE);
+            return size;
+        }
+
+        static std::ptrdiff_t round_up(std::ptrdiff_t n)
+        { return (n + page_size() - 1) / page_size() * page_size(); }
+
+        unique_fd _fd;
+        unique_mmap _mmap;
+        std::ptrdiff_t _size = 0;
+        std::ptrdiff_t _window;
+        std::ptrdiff_t _written_back = 0;
+        std::ptrdiff_t _synced = 0;
+    };
+
+    //mapped_file
+    //A read-only view of a whole file mapped into memory.
+    //For when you want the contents of a file without copying them.
+    //Throws if the file isn't a regular file (pipes, for example, can't be
+    //mapped).
+    class mapped_file {
+    public:
+        explicit mapped_file(const std::string& path)
+        {
+            auto fd = open(path.c_str(), O_RDONLY);
+            if (-1 == fd) {
+                throw std::system_error(errno, std::system_category());
+            }
+            unique_fd closer(fd);
+
+            struct stat info;
+            if (-1 == fstat(fd, &info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (!S_ISREG(info.st_mode)) {
+                throw std::system_error(ENODEV, std::system_category());
+            }
+            if (0 == info.st_size) return;
+
+            int flags = MAP_FILE | MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            //The whole file is wanted, so fault it all in up front.
+            flags |= MAP_POPULATE;
+#endif
+            auto p = mmap(nullptr, info.st_size, PROT_READ, flags, fd, 0);
+            if (MAP_FAILED == p) {
+                throw std::system_error(errno, std::system_category());
+            }
+            _mmap.reset(p, info.st_size);
+        }
+
+        gsl::span<const gsl::byte> bytes() const
+        {
+            return { _mmap.data(), static_cast<std::ptrdiff_t>(_mmap.size()) };
+        }
+
+    private:
+        unique_mmap _mmap;
+    };
+}
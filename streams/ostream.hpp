@@ -1,16 +1,22 @@
 #pragma once
 #include <algorithm>
+#include <array>
 #include <cstdio>
+#include <functional>
 #include <iterator>
 #include <memory>
 #include <string>
 #include <system_error>
+#include <utility>
+#include <vector>
 
 #include <gsl/gsl>
 #include <fmt/format.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 
 #include "streams_common.hpp"
 
@@ -33,6 +39,8 @@ namespace streams {
     //
     //To create your own stream, simply subclass and override _write().
     //You may also need to override _flush().
+    //Streams with a buffer of their own can also override _reserve() and
+    //_commit() to let callers write into it directly.
     //
     //If your subclass buffers or manages a data sink (like FILE*), you'll
     //want to include a non-virtual, no-throw flush operation in your dtor.
@@ -40,9 +48,7 @@ namespace streams {
     public:
         ostream() {}
         ostream(const ostream&) = delete;
-        ostream(ostream&&) = delete;
         ostream& operator=(const ostream&) = delete;
-        ostream& operator=(ostream&&) = delete;
         virtual ~ostream() {}
 
         std::ptrdiff_t write(gsl::span<const gsl::byte> bytes)
@@ -50,6 +56,27 @@ namespace streams {
 
         void flush() { _flush(); }
 
+        //Get n bytes of space inside the stream's own buffer, to generate
+        //output in place instead of building it elsewhere and copying it in
+        //with write(). Fill a prefix of the space, then commit() how many
+        //bytes were used. Don't write to the stream in between.
+        //
+        //Returns an empty span if the stream can't provide n contiguous
+        //bytes (because it has no buffer, or it isn't big enough). Fall back
+        //to write() in that case.
+        gsl::span<gsl::byte> reserve(std::ptrdiff_t n)
+        {
+            Expects(n >= 0);
+            return _reserve(n);
+        }
+
+        //Publish the first n bytes of the space from reserve().
+        void commit(std::ptrdiff_t n)
+        {
+            Expects(n >= 0);
+            _commit(n);
+        }
+
         //Write some binary/unformatted data in host endianess.
         template<typename T>
         void put(const T& t)
@@ -61,18 +88,28 @@ namespace streams {
             _write(gsl::as_bytes(s));
         }
 
+    protected:
+        //Only subclasses can move, so an ostream& can't be sliced. Those that
+        //hold nothing but values are movable without further ado.
+        ostream(ostream&&) = default;
+        ostream& operator=(ostream&&) = default;
+
     private:
         virtual std::ptrdiff_t _write(gsl::span<const gsl::byte>) = 0;
         virtual void _flush() {}
+        virtual gsl::span<gsl::byte> _reserve(std::ptrdiff_t) { return {}; }
+        virtual void _commit(std::ptrdiff_t n) { Expects(0 == n); }
     };
     
     //buf_ostream
     //Wrap another ostream and buffer output to it.
+    //
+    //The buffer is allocated up front and _used bytes of it are output, so
+    //space from reserve() is only output once it's committed.
     class buf_ostream: public ostream {
     public:
         explicit buf_ostream(ostream& os, std::ptrdiff_t size = 1024):
-            _sink(os)
-        { _buffer.reserve(size); }
+            _sink(os), _buffer(size) {}
 
         ~buf_ostream() { no_throw_flush(); }
 
@@ -81,13 +118,21 @@ namespace streams {
         //The virtual _flush will call this too.
         void non_virtual_flush()
         {
-            if (!_buffer.empty()) {
-                _sink.write(_buffer);
-                _buffer.clear();
-            }
+            write_buffer();
             _sink.flush();
         }
 
+        void write_buffer()
+        {
+            if (_used > 0) {
+                _sink.write(gsl::span<const gsl::byte>(_buffer).first(_used));
+                _used = 0;
+            }
+        }
+
+        gsl::span<gsl::byte> free_space()
+        { return gsl::span<gsl::byte>(_buffer).subspan(_used); }
+
         //Needed for flushing from dtor.
         void no_throw_flush() noexcept
         {
@@ -103,21 +148,35 @@ namespace streams {
         std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
         {
             auto total = bytes.size();
-            std::ptrdiff_t available = _buffer.capacity() - _buffer.size();
+            auto available = free_space().size();
             while (bytes.size() > available) {
-                auto first = bytes.first(available);
-                std::copy(first.begin(), first.end(),
-                        std::back_inserter(_buffer));
+                std::copy_n(bytes.begin(), available, free_space().begin());
+                _used += available;
                 flush();
                 bytes = bytes.subspan(available);
-                available = _buffer.capacity() - _buffer.size();
+                available = free_space().size();
             }
-            std::copy(bytes.begin(), bytes.end(), std::back_inserter(_buffer));
+            std::copy(bytes.begin(), bytes.end(), free_space().begin());
+            _used += bytes.size();
             return total;
         }
 
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            if (n > std::ptrdiff_t(_buffer.size())) return {};
+            if (n > free_space().size()) write_buffer();
+            return free_space().first(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            Expects(n <= free_space().size());
+            _used += n;
+        }
+
         ostream& _sink;
         std::vector<gsl::byte> _buffer;
+        std::ptrdiff_t _used = 0;
     };
 
     class span_ostream: public ostream {
@@ -135,21 +194,398 @@ namespace streams {
             return nbytes;
         }
 
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            if (n > _free.size()) return {};
+            return _free.first(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override { _free = _free.subspan(n); }
+
         gsl::span<gsl::byte> _free;
     };
 
+    //chained_span_ostream
+    //Writes across an ordered list of caller-provided spans, such as
+    //registered I/O buffers or shared-memory slots, filling each in turn.
+    //Nothing is ever allocated or copied anywhere but into those spans.
+    //
+    //When the last span is full, the optional `more` callback is asked for
+    //the next list. By then every span in the current list is full, so the
+    //callback can hand them off first. Without a callback, or if it returns
+    //an empty list (or only empty spans), writes come up short, just as
+    //with span_ostream.
+    //
+    //extent(i) is the filled part of span i of the current list.
+    class chained_span_ostream: public ostream {
+    public:
+        using span_list = gsl::span<const gsl::span<gsl::byte>>;
+        using overflow = std::function<span_list()>;
+
+        explicit chained_span_ostream(span_list spans, overflow more = {}):
+            _spans(spans),
+            _more(std::move(more))
+        {
+            if (_spans.size() > 0) _free = _spans[0];
+        }
+
+        //The number of spans in the current list that have been written to.
+        std::ptrdiff_t extents() const
+        {
+            if (_index >= _spans.size()) return _index;
+            return _index + ((used() > 0)? 1: 0);
+        }
+
+        gsl::span<gsl::byte> extent(std::ptrdiff_t i) const
+        {
+            Expects(i >= 0 && i < extents());
+            if (i < _index) return _spans[i];
+            return _spans[i].first(used());
+        }
+
+        //Total bytes written, across every list.
+        std::ptrdiff_t size() const { return _size; }
+
+    private:
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            std::ptrdiff_t written = 0;
+            while (written < bytes.size()) {
+                if (_free.size() <= 0 && !next_span()) break;
+                auto nbytes = std::min(bytes.size() - written, _free.size());
+                std::copy_n(bytes.begin() + written, nbytes, _free.begin());
+                _free = _free.subspan(nbytes);
+                written += nbytes;
+            }
+            _size += written;
+            return written;
+        }
+
+        //Reserved space never straddles two spans.
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            if (_free.size() <= 0) next_span();
+            if (n > _free.size()) return {};
+            return _free.first(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            _free = _free.subspan(n);
+            _size += n;
+        }
+
+        std::ptrdiff_t used() const
+        {
+            return _spans[_index].size() - _free.size();
+        }
+
+        //Move to the next non-empty span, asking for more if needed.
+        bool next_span()
+        {
+            while (true) {
+                if (_index + 1 < _spans.size()) {
+                    _free = _spans[++_index];
+                } else if (_more) {
+                    auto spans = _more();
+                    auto usable = std::find_if(spans.begin(), spans.end(),
+                            [](const gsl::span<gsl::byte>& span) {
+                                return span.size() > 0;
+                            });
+                    //Nothing to write into ends the output, like no spans.
+                    if (spans.end() == usable) return false;
+                    _spans = spans;
+                    _index = usable - spans.begin();
+                    _free = *usable;
+                } else {
+                    return false;
+                }
+                if (_free.size() > 0) return true;
+            }
+        }
+
+        span_list _spans;
+        overflow _more;
+        std::ptrdiff_t _index = 0;
+        gsl::span<gsl::byte> _free;
+        std::ptrdiff_t _size = 0;
+    };
+
+    //vector_ostream
+    //Appends output to a vector.
+    //
+    //reserve() grows the vector and hands out its new tail, so committed
+    //bytes are never copied. vector() is only ever what's been committed:
+    //it drops space that's reserved but not committed yet.
     class vector_ostream: public ostream {
     public:
-        std::vector<gsl::byte>& vector() { return _v; }
+        std::vector<gsl::byte>& vector()
+        {
+            cancel();
+            return _v;
+        }
 
     private:
         std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
         {
+            cancel();
             std::copy(bytes.begin(), bytes.end(), std::back_inserter(_v));
             return bytes.size();
         }
 
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            cancel();
+            _v.resize(_v.size() + n);
+            _reserved = n;
+            return gsl::span<gsl::byte>(_v).last(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            Expects(n <= _reserved);
+            _v.resize(_v.size() - (_reserved - n));
+            _reserved = 0;
+        }
+
+        //Forget the space from reserve().
+        void cancel()
+        {
+            _v.resize(_v.size() - _reserved);
+            _reserved = 0;
+        }
+
         std::vector<gsl::byte> _v;
+        //Bytes at the end of _v that are reserved, not committed.
+        std::ptrdiff_t _reserved = 0;
+    };
+
+    //small_ostream
+    //Collects output in N bytes of inline storage, so short results, such
+    //as formatted messages, never touch the heap. Once those fill up, output
+    //continues in a chain of heap chunks, each twice the size of the last.
+    //Chunks are never copied while writing.
+    //
+    //view() is the whole result as one span. If output has spilled, the
+    //chunks are joined first. for_each_segment() visits the pieces without
+    //joining them.
+    template<std::ptrdiff_t N = 256>
+    class small_ostream: public ostream {
+    public:
+        static_assert(N > 0, "small_ostream needs inline storage");
+
+        std::ptrdiff_t size() const { return _size; }
+        bool spilled() const { return !_chunks.empty(); }
+
+        gsl::span<const gsl::byte> view()
+        {
+            if (!spilled()) {
+                return gsl::span<const gsl::byte>(_inline).first(_inline_used);
+            }
+            if (_chunks.size() > 1 || _inline_used > 0) join();
+            auto& c = _chunks.front();
+            return { c.data.get(), c.used };
+        }
+
+        template<typename F>
+        void for_each_segment(F f) const
+        {
+            if (_inline_used > 0) {
+                f(gsl::span<const gsl::byte>(_inline).first(_inline_used));
+            }
+            for (auto& c: _chunks) {
+                if (c.used <= 0) continue;
+                f(gsl::span<const gsl::byte>(c.data.get(), c.used));
+            }
+        }
+
+        std::string str() const
+        {
+            std::string s;
+            s.reserve(_size);
+            for_each_segment([&s](gsl::span<const gsl::byte> bytes) {
+                    s.append(reinterpret_cast<const char*>(bytes.data()),
+                            bytes.size());
+                });
+            return s;
+        }
+
+        void write_to(ostream& out) const
+        {
+            for_each_segment(
+                    [&out](gsl::span<const gsl::byte> bytes) {
+                        out.write(bytes);
+                    });
+        }
+
+        void clear()
+        {
+            _chunks.clear();
+            _next = 2 * N;
+            _inline_used = 0;
+            _size = 0;
+        }
+
+    private:
+        struct chunk {
+            std::unique_ptr<gsl::byte[]> data;
+            std::ptrdiff_t capacity;
+            std::ptrdiff_t used;
+        };
+
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            auto left = bytes;
+            while (left.size() > 0) {
+                auto space = free_space();
+                if (space.size() <= 0) {
+                    add_chunk(left.size());
+                    continue;
+                }
+                auto n = std::min(space.size(), left.size());
+                std::copy_n(left.begin(), n, space.begin());
+                advance(n);
+                left = left.subspan(n);
+            }
+            return bytes.size();
+        }
+
+        gsl::span<gsl::byte> _reserve(std::ptrdiff_t n) override
+        {
+            if (n > free_space().size()) add_chunk(n);
+            return free_space().first(n);
+        }
+
+        void _commit(std::ptrdiff_t n) override
+        {
+            Expects(n <= free_space().size());
+            advance(n);
+        }
+
+        gsl::span<gsl::byte> free_space()
+        {
+            if (!spilled()) {
+                return gsl::span<gsl::byte>(_inline).subspan(_inline_used);
+            }
+            auto& c = _chunks.back();
+            return { c.data.get() + c.used, c.capacity - c.used };
+        }
+
+        void advance(std::ptrdiff_t n)
+        {
+            if (spilled()) _chunks.back().used += n;
+            else _inline_used += n;
+            _size += n;
+        }
+
+        void add_chunk(std::ptrdiff_t n)
+        {
+            auto capacity = std::max(n, _next);
+            _next = 2 * capacity;
+            _chunks.push_back(chunk{
+                    std::unique_ptr<gsl::byte[]>(new gsl::byte[capacity]),
+                    capacity, 0 });
+        }
+
+        //Replace the inline bytes and the chunks with a single chunk.
+        void join()
+        {
+            auto capacity = std::max(_size, _next);
+            chunk joined{
+                std::unique_ptr<gsl::byte[]>(new gsl::byte[capacity]),
+                capacity, 0 };
+            for_each_segment([&joined](gsl::span<const gsl::byte> bytes) {
+                    std::copy_n(bytes.begin(), bytes.size(),
+                            joined.data.get() + joined.used);
+                    joined.used += bytes.size();
+                });
+            _chunks.clear();
+            _chunks.push_back(std::move(joined));
+            _inline_used = 0;
+        }
+
+        std::array<gsl::byte, N> _inline;
+        std::ptrdiff_t _inline_used = 0;
+        std::vector<chunk> _chunks;
+        std::ptrdiff_t _next = 2 * N;
+        std::ptrdiff_t _size = 0;
+    };
+
+    //batch_writer
+    //Collects many small writes and sends them to an ostream in one write().
+    //
+    //The put() and write() members are inline and non-virtual, so writing a
+    //record field by field costs one virtual call per batch, instead of one
+    //per field for every filter the output passes through.
+    //
+    //If the ostream can reserve() N bytes, the batch is written straight
+    //into its buffer. Otherwise it's staged inside the batch_writer.
+    //
+    //  streams::batch_writer<> batch(out);
+    //  batch.put(student.id);
+    //  batch.put(student.gpa);
+    //  batch.commit(); //Or let the dtor do it.
+    //
+    //The staging space is inside the batch_writer itself, so keep it on the
+    //stack and keep N modest. Don't write to the ostream while it's in use.
+    template<std::ptrdiff_t N = 512>
+    class batch_writer {
+    public:
+        explicit batch_writer(ostream& os): _sink(os) {}
+        batch_writer(const batch_writer&) = delete;
+        batch_writer& operator=(const batch_writer&) = delete;
+
+        ~batch_writer() { no_throw_commit(); }
+
+        template<typename T>
+        void put(const T& t)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                    "Cannot use put() on values that are not trivially "
+                    "copyable.");
+            write(gsl::as_bytes(gsl::span<const T>{&t, 1}));
+        }
+
+        void write(gsl::span<const gsl::byte> bytes)
+        {
+            if (bytes.size() > _space.size() - _used) {
+                commit();
+                //Too big to stage at all.
+                if (bytes.size() > N) {
+                    _sink.write(bytes);
+                    return;
+                }
+                _space = _sink.reserve(N);
+                _direct = _space.size() > 0;
+                if (!_direct) _space = gsl::span<gsl::byte>(_buffer);
+            }
+            std::copy(bytes.begin(), bytes.end(), _space.begin() + _used);
+            _used += bytes.size();
+        }
+
+        //Send everything staged so far down to the ostream.
+        void commit()
+        {
+            if (_direct) _sink.commit(_used);
+            else if (_used > 0) _sink.write(_space.first(_used));
+            _space = {};
+            _direct = false;
+            _used = 0;
+        }
+
+    private:
+        //Needed for committing from dtor.
+        void no_throw_commit() noexcept
+        {
+            try { commit(); }
+            catch (...) {}
+        }
+
+        ostream& _sink;
+        gsl::byte _buffer[N];
+        gsl::span<gsl::byte> _space;
+        bool _direct = false;
+        std::ptrdiff_t _used = 0;
     };
 
     ////////////////////////////////////////////////////////////////////////////
@@ -329,6 +765,62 @@ namespace streams {
         std::unique_ptr<std::FILE, Closer> _f;
     };
 
+    //sigpipe_guard
+    //Blocks SIGPIPE on this thread while it lives, so writing to a pipe
+    //whose reader has gone fails with EPIPE instead of killing the whole
+    //process. A SIGPIPE raised meanwhile is taken off the pending set
+    //before the old signal mask comes back, unless one was pending before.
+    class sigpipe_guard {
+    public:
+        sigpipe_guard()
+        {
+            sigemptyset(&_sigpipe);
+            sigaddset(&_sigpipe, SIGPIPE);
+            sigset_t pending;
+            sigpending(&pending);
+            _was_pending = sigismember(&pending, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &_sigpipe, &_old);
+        }
+
+        sigpipe_guard(const sigpipe_guard&) = delete;
+        sigpipe_guard& operator=(const sigpipe_guard&) = delete;
+
+        ~sigpipe_guard()
+        {
+            if (!_was_pending) {
+                sigset_t pending;
+                sigpending(&pending);
+                if (sigismember(&pending, SIGPIPE)) {
+                    timespec zero{};
+                    while (-1 == sigtimedwait(&_sigpipe, nullptr, &zero)
+                            && EINTR == errno);
+                }
+            }
+            pthread_sigmask(SIG_SETMASK, &_old, nullptr);
+        }
+
+    private:
+        sigset_t _sigpipe;
+        sigset_t _old;
+        bool _was_pending;
+    };
+
+    //write_to_pipe
+    //Write all of bytes to a pipe. If the reader has gone, this throws a
+    //system_error with EPIPE rather than raising SIGPIPE.
+    void write_to_pipe(int fd, gsl::span<const gsl::byte> bytes)
+    {
+        sigpipe_guard guard;
+        while (bytes.size() > 0) {
+            auto n = ::write(fd, bytes.data(), bytes.size());
+            if (-1 == n && EINTR == errno) continue;
+            if (-1 == n) {
+                throw std::system_error(errno, std::system_category());
+            }
+            bytes = bytes.subspan(n);
+        }
+    }
+
     template<typename T>
     class posix_base_ostream: public ostream {
     public:
@@ -370,30 +862,44 @@ namespace streams {
         int _fd;
     };
 
+    //open_for_output
+    //Open a file the way the file ostreams do: created if need be, and
+    //either truncated or appended to. Throws on failure.
+    int open_for_output(const std::string& path, bool append)
+    {
+        auto fd = open(path.c_str(),
+                O_CREAT | O_WRONLY | (append? O_APPEND: O_TRUNC),
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (-1 == fd) {
+            throw std::system_error(errno, std::system_category());
+        }
+        return fd;
+    }
+
     class posix_file_ostream:
         public posix_base_ostream<posix_file_ostream>,
         public posix_fd_seekable<posix_file_ostream>
     {
-        static int oflag(bool append)
-        { return O_CREAT | O_WRONLY | (append? O_APPEND: O_TRUNC); }
-
-        static mode_t mode()
-        { return S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; }
-
     public:
         explicit posix_file_ostream(
                 const std::string& path, bool append = false):
-            _fd(open(path.c_str(), oflag(append), mode()))
+            _fd(open_for_output(path, append)) {}
+
+        posix_file_ostream(posix_file_ostream&& other) noexcept:
+            _fd(other._fd)
+        { other._fd = -1; }
+
+        posix_file_ostream& operator=(posix_file_ostream&& other) noexcept
         {
-            if (-1 == _fd) {
-                throw std::system_error(errno, std::system_category());
-            }
+            std::swap(_fd, other._fd);
+            return *this;
         }
 
         int fd() { return _fd; }
 
         ~posix_file_ostream()
         {
+            if (-1 == _fd) return;
             fsync(_fd);
             close(_fd);
         }
@@ -0,0 +1,659 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+#include "queue.hpp"
+
+namespace streams {
+    //buffer_pool
+    //Hands out reference-counted byte buffers. When the last reference to
+    //one goes away, it comes back here, capacity and all, to be reused.
+    class buffer_pool {
+    public:
+        using buffer = std::shared_ptr<std::vector<gsl::byte>>;
+
+        //An empty buffer, with whatever capacity it had before.
+        buffer get()
+        {
+            std::unique_ptr<std::vector<gsl::byte>> v;
+            {
+                std::lock_guard<std::mutex> lock(_free->mutex);
+                if (!_free->buffers.empty()) {
+                    v = std::move(_free->buffers.back());
+                    _free->buffers.pop_back();
+                }
+            }
+            if (!v) v.reset(new std::vector<gsl::byte>);
+            v->clear();
+            return buffer(v.release(), Recycler{_free});
+        }
+
+    private:
+        struct Free {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<std::vector<gsl::byte>>> buffers;
+        };
+
+        //Shares ownership of the free list, so buffers can outlive the pool.
+        struct Recycler {
+            std::shared_ptr<Free> free;
+
+            void operator()(std::vector<gsl::byte>* v)
+            {
+                std::unique_ptr<std::vector<gsl::byte>> owned(v);
+                std::lock_guard<std::mutex> lock(free->mutex);
+                free->buffers.push_back(std::move(owned));
+            }
+        };
+
+        std::shared_ptr<Free> _free = std::make_shared<Free>();
+    };
+
+    //pipeline_options
+    struct pipeline_options {
+        //How much the source reads at a time.
+        std::ptrdiff_t chunk_size = 64 * 1024;
+        //How many chunks can wait between two threads.
+        std::ptrdiff_t queue_depth = 8;
+        //If set, chunks end just after this byte, so records (e.g. lines)
+        //aren't split between chunks. A chunk grows past chunk_size if it
+        //must to hold a whole record.
+        optional<gsl::byte> delimiter;
+    };
+
+    //stage_metrics
+    //What each stage did during pipeline::run(), summed over its threads.
+    struct stage_metrics {
+        std::string name;
+        std::ptrdiff_t chunks = 0;
+        std::ptrdiff_t bytes_in = 0;
+        std::ptrdiff_t bytes_out = 0;
+        //Time spent in the transform.
+        std::chrono::nanoseconds busy{0};
+        //Time spent waiting for input, or for room downstream.
+        std::chrono::nanoseconds waiting{0};
+    };
+
+    //pipeline
+    //Runs a source istream through a chain of transforms into an ostream,
+    //with every stage on its own threads:
+    //
+    //  streams::pipeline p(in);
+    //  p.then("decompress", decompress)
+    //   .then("rewrite", rewrite_records, 4)
+    //   .run(out);
+    //
+    //The source is read in chunks (see pipeline_options). Each transform is
+    //called once per chunk with the chunk's bytes and an ostream for its
+    //output, which becomes the chunk passed to the next stage. A stage
+    //with a parallelism above one runs that many copies of the transform
+    //at once, so the transform mustn't keep state between chunks. Chunks
+    //still reach the sink in their original order.
+    //
+    //Chunks are pooled, reference-counted buffers moved between threads
+    //through bounded single-producer, single-consumer queues, so a slow
+    //stage holds back the ones before it instead of letting chunks pile up.
+    //
+    //The first exception from any stage stops the pipeline, and run()
+    //rethrows it once every thread has finished.
+    class pipeline {
+    public:
+        using transform =
+            std::function<void(gsl::span<const gsl::byte>, ostream&)>;
+
+        explicit pipeline(
+                istream& source,
+                const pipeline_options& options = pipeline_options()):
+            _source(source),
+            _options(options)
+        { Expects(options.chunk_size > 0 && options.queue_depth > 0); }
+
+        pipeline& then(
+                std::string name, transform f, std::ptrdiff_t parallelism = 1)
+        {
+            Expects(parallelism > 0);
+            _stages.push_back(stage{ std::move(name), std::move(f),
+                    parallelism });
+            return *this;
+        }
+
+        void run(ostream& sink)
+        {
+            //Link i feeds stage i; the last link feeds the sink.
+            std::ptrdiff_t stages = _stages.size();
+            _links.clear();
+            std::ptrdiff_t from = 1;
+            for (std::ptrdiff_t i = 0; i <= stages; ++i) {
+                auto to = (i < stages)? _stages[i].parallelism: 1;
+                link l{ from, to, {} };
+                for (std::ptrdiff_t q = 0; q < from * to; ++q) {
+                    l.queues.emplace_back(new queue(_options.queue_depth));
+                }
+                _links.push_back(std::move(l));
+                from = to;
+            }
+
+            std::vector<std::vector<stage_metrics>> per_thread(stages);
+            std::vector<std::thread> threads;
+            threads.emplace_back(
+                    [this]() { guard([&]() { read_source(); }); });
+            for (std::ptrdiff_t s = 0; s < stages; ++s) {
+                per_thread[s].resize(_stages[s].parallelism);
+                for (std::ptrdiff_t w = 0; w < _stages[s].parallelism; ++w) {
+                    auto& m = per_thread[s][w];
+                    threads.emplace_back([this, s, w, &m]() {
+                            guard([&]() { run_worker(s, w, m); });
+                        });
+                }
+            }
+            guard([&]() { write_sink(sink); });
+            for (auto& t: threads) t.join();
+
+            _metrics.clear();
+            for (std::ptrdiff_t s = 0; s < stages; ++s) {
+                stage_metrics total;
+                total.name = _stages[s].name;
+                for (auto& m: per_thread[s]) {
+                    total.chunks += m.chunks;
+                    total.bytes_in += m.bytes_in;
+                    total.bytes_out += m.bytes_out;
+                    total.busy += m.busy;
+                    total.waiting += m.waiting;
+                }
+                _metrics.push_back(std::move(total));
+            }
+            if (_exception) std::rethrow_exception(_exception);
+        }
+
+        //One entry per stage, after run().
+        const std::vector<stage_metrics>& metrics() const { return _metrics; }
+
+    private:
+        using buffer = buffer_pool::buffer;
+        using queue = spsc_queue<buffer>;
+        using clock = std::chrono::steady_clock;
+
+        struct stage {
+            std::string name;
+            transform f;
+            std::ptrdiff_t parallelism;
+        };
+
+        //The queues from the `from` threads of one stage to the `to` threads
+        //of the next. Chunk i goes from thread i % from to thread i % to.
+        struct link {
+            std::ptrdiff_t from;
+            std::ptrdiff_t to;
+            std::vector<std::unique_ptr<queue>> queues;
+
+            queue& between(std::ptrdiff_t f, std::ptrdiff_t t)
+            { return *queues[f * to + t]; }
+        };
+
+        template<typename F>
+        void guard(F f)
+        {
+            try {
+                f();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_exception) _exception = std::current_exception();
+                }
+                close_all();
+            }
+        }
+
+        void close_all()
+        {
+            for (auto& l: _links) for (auto& q: l.queues) q->close();
+        }
+
+        void read_source()
+        {
+            auto& out = _links.front();
+            std::vector<gsl::byte> carry;
+            bool eof = false;
+            for (std::ptrdiff_t i = 0; !eof; ++i) {
+                auto chunk = _pool.get();
+                chunk->swap(carry);
+                carry.clear();
+                eof = read_chunk(*chunk, carry);
+                if (chunk->empty()) break;
+                if (!out.between(0, i % out.to).push(std::move(chunk))) return;
+            }
+            for (auto& q: out.queues) q->close();
+        }
+
+        //Fill the chunk (which starts with the last one's leftovers) from
+        //the source, moving any partial record at the end into carry.
+        //Returns true at the end of the source.
+        bool read_chunk(
+                std::vector<gsl::byte>& chunk, std::vector<gsl::byte>& carry)
+        {
+            std::ptrdiff_t want = std::max<std::ptrdiff_t>(
+                    _options.chunk_size, chunk.size());
+            while (true) {
+                std::ptrdiff_t have = chunk.size();
+                chunk.resize(want);
+                auto got = _source.read(
+                        gsl::span<gsl::byte>(chunk).subspan(have));
+                chunk.resize(have + got.size());
+                if (got.size() < want - have) return true;
+                if (!_options.delimiter) return false;
+                auto last = std::find(chunk.rbegin(), chunk.rend(),
+                        *_options.delimiter);
+                if (chunk.rend() != last) {
+                    carry.assign(last.base(), chunk.end());
+                    chunk.erase(last.base(), chunk.end());
+                    return false;
+                }
+                //No whole record yet.
+                want *= 2;
+            }
+        }
+
+        void run_worker(
+                std::ptrdiff_t s, std::ptrdiff_t w, stage_metrics& m)
+        {
+            auto& in = _links[s];
+            auto& out = _links[s + 1];
+            auto& f = _stages[s].f;
+            auto parallelism = _stages[s].parallelism;
+            vector_ostream writer;
+            //This thread handles chunks w, w + parallelism, and so on.
+            for (std::ptrdiff_t i = w;; i += parallelism) {
+                auto start = clock::now();
+                auto chunk = in.between(i % in.from, w).pop();
+                auto popped = clock::now();
+                if (!chunk) break;
+
+                //Build the output in a pooled buffer.
+                auto result = _pool.get();
+                writer.vector().swap(*result);
+                f(gsl::span<const gsl::byte>(**chunk), writer);
+                writer.vector().swap(*result);
+                auto transformed = clock::now();
+
+                m.chunks += 1;
+                m.bytes_in += (*chunk)->size();
+                m.bytes_out += result->size();
+                chunk = nullopt;
+                auto& next = out.between(w, i % out.to);
+                bool pushed = next.push(std::move(result));
+                m.busy += transformed - popped;
+                m.waiting += (popped - start) + (clock::now() - transformed);
+                if (!pushed) return;
+            }
+            for (std::ptrdiff_t t = 0; t < out.to; ++t) {
+                out.between(w, t).close();
+            }
+        }
+
+        void write_sink(ostream& sink)
+        {
+            auto& in = _links.back();
+            for (std::ptrdiff_t i = 0;; ++i) {
+                auto chunk = in.between(i % in.from, 0).pop();
+                if (!chunk) break;
+                sink.write(**chunk);
+            }
+        }
+
+        istream& _source;
+        pipeline_options _options;
+        std::vector<stage> _stages;
+        std::vector<link> _links;
+        buffer_pool _pool;
+        std::vector<stage_metrics> _metrics;
+        std::mutex _mutex;
+        std::exception_ptr _exception;
+    };
+
+    //record_batcher
+    //Cuts a stream of bytes into batches of about batch_size. With a
+    //delimiter, each batch ends just after one, so records (e.g. lines)
+    //aren't split between batches; a batch grows past batch_size if it
+    //must to hold a whole record.
+    class record_batcher {
+    public:
+        record_batcher(
+                buffer_pool& pool,
+                std::ptrdiff_t batch_size,
+                optional<gsl::byte> delimiter):
+            _pool(pool),
+            _batch_size(batch_size),
+            _delimiter(delimiter)
+        { Expects(batch_size > 0); }
+
+        //Add bytes, passing each batch that's ready to submit.
+        template<typename F>
+        void add(gsl::span<const gsl::byte> bytes, F submit)
+        {
+            while (bytes.size() > 0) {
+                if (!_batch) _batch = _pool.get();
+                std::ptrdiff_t room = _batch_size - _batch->size();
+                std::ptrdiff_t n = std::min(room, bytes.size());
+                if (room <= 0) {
+                    //A full batch with no whole record yet: add bytes up to
+                    //the end of the record.
+                    auto end = std::find(bytes.begin(), bytes.end(),
+                            *_delimiter);
+                    n = (bytes.end() == end)? bytes.size():
+                        end - bytes.begin() + 1;
+                }
+                _batch->insert(_batch->end(), bytes.begin(), bytes.begin() + n);
+                bytes = bytes.subspan(n);
+                if (std::ptrdiff_t(_batch->size()) >= _batch_size) cut(submit);
+            }
+        }
+
+        //Pass on whatever's left, even a partial record.
+        template<typename F>
+        void finish(F submit)
+        {
+            if (_batch && !_batch->empty()) submit(std::move(_batch));
+            _batch = nullptr;
+        }
+
+    private:
+        //Pass on the batch, keeping any partial record at its end.
+        template<typename F>
+        void cut(F& submit)
+        {
+            if (!_delimiter) {
+                submit(std::move(_batch));
+                _batch = nullptr;
+                return;
+            }
+            auto last = std::find(_batch->rbegin(), _batch->rend(),
+                    *_delimiter);
+            if (_batch->rend() == last) return;
+            auto rest = _pool.get();
+            rest->assign(last.base(), _batch->end());
+            _batch->erase(last.base(), _batch->end());
+            submit(std::move(_batch));
+            _batch = std::move(rest);
+        }
+
+        buffer_pool& _pool;
+        std::ptrdiff_t _batch_size;
+        optional<gsl::byte> _delimiter;
+        buffer_pool::buffer _batch;
+    };
+
+    //reorder_buffer
+    //Writes numbered results to an ostream in number order, starting from
+    //zero, whatever order and threads they arrive from.
+    //
+    //A result that arrives early waits here. Whoever delivers the one that's
+    //due writes it and everything ready after it, outside the lock, so other
+    //threads can keep delivering meanwhile.
+    //
+    //It also holds the first error of whatever is producing the results, so
+    //waiters can give up.
+    class reorder_buffer {
+    public:
+        explicit reorder_buffer(ostream& sink): _sink(sink) {}
+
+        //Throws if writing to the sink fails.
+        void put(std::ptrdiff_t seq, buffer_pool::buffer bytes)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.emplace(seq, std::move(bytes));
+            if (_draining) return;
+            drain(lock, false);
+        }
+
+        //Flush the sink between writes, never during one, after writing
+        //whatever is due. Doesn't wait for results that haven't arrived.
+        void flush()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _progress.wait(lock, [this]() { return !_draining; });
+            drain(lock, true);
+        }
+
+        //Wait until the first n results are written, or for an error.
+        void wait_for(std::ptrdiff_t n)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _progress.wait(lock,
+                    [this, n]() { return _exception || _written >= n; });
+        }
+
+        //Keep the first error, and wake all the waiters.
+        void fail(std::exception_ptr e)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_exception) _exception = e;
+            _progress.notify_all();
+        }
+
+        bool failed()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return bool(_exception);
+        }
+
+        void rethrow()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_exception) std::rethrow_exception(_exception);
+        }
+
+    private:
+        //Write what's due, in order, and then flush the sink if asked.
+        //Only one thread drains at a time; the sink is used outside the
+        //lock.
+        void drain(std::unique_lock<std::mutex>& lock, bool flush)
+        {
+            _draining = true;
+            try {
+                while (!_exception) {
+                    auto next = _done.find(_written);
+                    if (_done.end() == next) {
+                        if (!flush) break;
+                        flush = false;
+                        lock.unlock();
+                        _sink.flush();
+                        lock.lock();
+                        continue;
+                    }
+                    auto due = std::move(next->second);
+                    _done.erase(next);
+                    lock.unlock();
+                    _sink.write(*due);
+                    due = nullptr;
+                    lock.lock();
+                    ++_written;
+                    _progress.notify_all();
+                }
+            } catch (...) {
+                if (!lock.owns_lock()) lock.lock();
+                _draining = false;
+                _progress.notify_all();
+                throw;
+            }
+            _draining = false;
+            _progress.notify_all();
+        }
+
+        ostream& _sink;
+        std::mutex _mutex;
+        std::condition_variable _progress;
+        std::map<std::ptrdiff_t, buffer_pool::buffer> _done;
+        std::ptrdiff_t _written = 0;
+        bool _draining = false;
+        std::exception_ptr _exception;
+    };
+
+    //parallel_options
+    struct parallel_options {
+        //Worker threads. Zero means one per core.
+        std::ptrdiff_t workers = 0;
+        //Output is handed to the workers in batches of about this size.
+        std::ptrdiff_t batch_size = 64 * 1024;
+        //Batches handed out but not yet written to the sink, including
+        //those waiting in the reorder buffer. Zero means twice the workers.
+        std::ptrdiff_t max_in_flight = 0;
+        //If set, batches end just after this byte, so records (e.g. lines)
+        //aren't split between batches, except by flush().
+        optional<gsl::byte> delimiter;
+    };
+
+    //parallel_ostream
+    //A filter that runs a stateless transform on worker threads, then puts
+    //the results back in order before writing them to the sink:
+    //
+    //  streams::parallel_ostream shout(streams::stdouts, to_upper);
+    //  streams::copy(in, shout);
+    //
+    //Written bytes are cut into batches (see record_batcher) and queued for
+    //whichever worker is free. Finished batches go through a reorder_buffer
+    //on their way to the sink. At most max_in_flight batches exist at once;
+    //write() waits for room beyond that.
+    //
+    //flush() sends the current batch off, even mid-record, then waits for
+    //all the batches to reach the sink and flushes it. An exception from
+    //the transform or the sink is rethrown by the next write() or flush().
+    class parallel_ostream: public ostream {
+    public:
+        using transform = pipeline::transform;
+
+        parallel_ostream(
+                ostream& sink,
+                transform f,
+                const parallel_options& options = parallel_options()):
+            _sink(sink),
+            _f(std::move(f)),
+            _options(defaults(options)),
+            _batcher(_pool, _options.batch_size, _options.delimiter),
+            _reorder(sink),
+            _jobs(_options.max_in_flight)
+        {
+            for (std::ptrdiff_t i = 0; i < _options.workers; ++i) {
+                _workers.emplace_back([this]() { work(); });
+            }
+        }
+
+        ~parallel_ostream()
+        {
+            no_throw_flush();
+            _jobs.close();
+            for (auto& t: _workers) t.join();
+        }
+
+    private:
+        struct job {
+            std::ptrdiff_t seq;
+            buffer_pool::buffer bytes;
+        };
+
+        static parallel_options defaults(parallel_options options)
+        {
+            if (options.workers <= 0) {
+                options.workers =
+                    std::max(1u, std::thread::hardware_concurrency());
+            }
+            if (options.max_in_flight <= 0) {
+                options.max_in_flight = 2 * options.workers;
+            }
+            return options;
+        }
+
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            _reorder.rethrow();
+            _batcher.add(bytes,
+                    [this](buffer_pool::buffer b) { submit(std::move(b)); });
+            return bytes.size();
+        }
+
+        void _flush() override { non_virtual_flush(); }
+
+        void non_virtual_flush()
+        {
+            _batcher.finish(
+                    [this](buffer_pool::buffer b) { submit(std::move(b)); });
+            _reorder.wait_for(_next);
+            _reorder.rethrow();
+            _sink.flush();
+        }
+
+        void no_throw_flush() noexcept
+        {
+            try { non_virtual_flush(); }
+            catch (...) {}
+        }
+
+        void submit(buffer_pool::buffer bytes)
+        {
+            _reorder.wait_for(_next - _options.max_in_flight + 1);
+            _reorder.rethrow();
+            _jobs.push(job{ _next++, std::move(bytes) });
+        }
+
+        void work()
+        {
+            vector_ostream writer;
+            while (auto j = _jobs.pop()) {
+                try {
+                    if (_reorder.failed()) continue;
+                    auto result = _pool.get();
+                    writer.vector().swap(*result);
+                    _f(gsl::span<const gsl::byte>(*j->bytes), writer);
+                    writer.vector().swap(*result);
+                    j->bytes = nullptr;
+                    _reorder.put(j->seq, std::move(result));
+                } catch (...) {
+                    _reorder.fail(std::current_exception());
+                }
+            }
+        }
+
+        ostream& _sink;
+        transform _f;
+        parallel_options _options;
+        buffer_pool _pool;
+        record_batcher _batcher;
+        reorder_buffer _reorder;
+        blocking_queue<job> _jobs;
+        std::ptrdiff_t _next = 0;
+        std::vector<std::thread> _workers;
+    };
+
+    //parallel_transform
+    //Read all of an istream through a parallel_ostream into an ostream.
+    void parallel_transform(
+            istream& in,
+            ostream& out,
+            parallel_ostream::transform f,
+            const parallel_options& options = parallel_options())
+    {
+        parallel_ostream filter(out, std::move(f), options);
+        std::vector<gsl::byte> buffer(options.batch_size);
+        while (true) {
+            auto got = in.read(buffer);
+            if (0 == got.size()) break;
+            filter.write(got);
+        }
+        filter.flush();
+    }
+}
@@ -0,0 +1,564 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+#include "pipeline.hpp"
+
+extern char** environ;
+
+namespace streams {
+    //subprocess
+    //Runs a program directly with posix_spawnp(), without a shell. The
+    //program is found on the PATH, and argv[0] is its name.
+    //
+    //in and out are file descriptors to give the child as its standard
+    //input and output, or -1 to share ours. Our own descriptors
+    //should be opened with O_CLOEXEC, so the child doesn't inherit them.
+    //
+    //The destructor waits for the child to exit, if wait() hasn't.
+    class subprocess {
+    public:
+        explicit subprocess(
+                const std::vector<std::string>& argv,
+                int in = -1,
+                int out = -1)
+        {
+            Expects(!argv.empty());
+            std::vector<char*> args;
+            for (auto& arg: argv) {
+                args.push_back(const_cast<char*>(arg.c_str()));
+            }
+            args.push_back(nullptr);
+
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            if (-1 != in) posix_spawn_file_actions_adddup2(&actions, in, 0);
+            if (-1 != out) posix_spawn_file_actions_adddup2(&actions, out, 1);
+            auto error = posix_spawnp(&_pid, args[0], &actions, nullptr,
+                    args.data(), environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (0 != error) {
+                throw std::system_error(error, std::system_category());
+            }
+        }
+
+        subprocess(subprocess&& other) noexcept:
+            _pid(std::exchange(other._pid, -1)),
+            _status(other._status)
+        {}
+
+        subprocess& operator=(subprocess&& other) noexcept
+        {
+            std::swap(_pid, other._pid);
+            std::swap(_status, other._status);
+            return *this;
+        }
+
+        ~subprocess()
+        {
+            try { wait(); }
+            catch (...) {}
+        }
+
+        pid_t pid() const { return _pid; }
+
+        //Wait for the child to exit. Returns its exit status, or 128 plus
+        //the signal number if a signal killed it, as shells do.
+        int wait()
+        {
+            if (-1 == _pid) return _status;
+            int status;
+            while (-1 == waitpid(_pid, &status, 0)) {
+                if (EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+            }
+            _pid = -1;
+            _status = WIFEXITED(status)? WEXITSTATUS(status):
+                128 + WTERMSIG(status);
+            return _status;
+        }
+
+    private:
+        pid_t _pid = -1;
+        int _status = 0;
+    };
+
+    //pipe_ostream
+    //Writes to the end of a pipe that it owns. close() sends end of file.
+    class pipe_ostream: public posix_base_ostream<pipe_ostream> {
+    public:
+        explicit pipe_ostream(int fd = -1): _fd(fd) {}
+
+        pipe_ostream(pipe_ostream&&) = default;
+        pipe_ostream& operator=(pipe_ostream&&) = default;
+
+        int fd() { return _fd.get(); }
+
+        void close() { _fd.reset(); }
+
+    private:
+        //Throws EPIPE, rather than raising SIGPIPE, if the reader has gone.
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            write_to_pipe(_fd.get(), bytes);
+            return bytes.size();
+        }
+
+        //Pipes can't be fsync()ed, and there's nothing to flush.
+        void _flush() override {}
+
+        unique_fd _fd;
+    };
+
+    //pipe_istream
+    //Reads from the end of a pipe that it owns.
+    class pipe_istream: public posix_base_istream<pipe_istream> {
+    public:
+        explicit pipe_istream(int fd = -1): _fd(fd) {}
+
+        pipe_istream(pipe_istream&&) = default;
+        pipe_istream& operator=(pipe_istream&&) = default;
+
+        int fd() { return _fd.get(); }
+
+        void close() { _fd.reset(); }
+
+    private:
+        unique_fd _fd;
+    };
+
+    //make_pipe
+    //Create a pipe, with both ends closed on exec. If size is given, ask
+    //for a pipe buffer that big with F_SETPIPE_SZ. Unprivileged processes
+    //can't go past /proc/sys/fs/pipe-max-size; if the kernel refuses, the
+    //pipe keeps the default size.
+    std::pair<pipe_istream, pipe_ostream> make_pipe(std::ptrdiff_t size = 0)
+    {
+        int fds[2];
+        if (-1 == pipe2(fds, O_CLOEXEC)) {
+            throw std::system_error(errno, std::system_category());
+        }
+        std::pair<pipe_istream, pipe_ostream> ends{
+            pipe_istream(fds[0]), pipe_ostream(fds[1]) };
+#ifdef F_SETPIPE_SZ
+        if (size > 0) fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(size));
+#endif
+        return ends;
+    }
+
+    //process_chain
+    //Runs commands connected like a shell pipeline, a | b | c, but without
+    //a shell:
+    //
+    //  streams::process_chain chain({ { "grep", "error" }, { "sort" } });
+    //  streams::copy(log, chain.input());
+    //  chain.input().close();
+    //  auto sorted = streams::read_all(chain.output());
+    //  chain.wait();
+    //
+    //Data passes from one command to the next through the kernel alone, in
+    //pipes enlarged to pipe_size. The first command's standard input and
+    //the last one's standard output can each be:
+    //
+    //  * process_chain::piped: A pipe, whose other end is input() or
+    //    output(). They're posix fd streams, so copy() can splice() data
+    //    between them and files or sockets without copying it through
+    //    user space.
+    //  * A file descriptor of ours, which the command uses directly.
+    //  * -1, to share ours.
+    //
+    //As with any pipe, reading output() only after writing all of input()
+    //can deadlock once the pipes fill up. Use a thread, or a file.
+    class process_chain {
+    public:
+        static constexpr int piped = -2;
+
+        explicit process_chain(
+                const std::vector<std::vector<std::string>>& commands,
+                int in = piped,
+                int out = piped,
+                std::ptrdiff_t pipe_size = 1024 * 1024)
+        {
+            Expects(!commands.empty());
+            //The read end for the next command's standard input.
+            pipe_istream upstream;
+            if (piped == in) {
+                auto p = make_pipe(pipe_size);
+                upstream = std::move(p.first);
+                _input = std::move(p.second);
+                in = upstream.fd();
+            }
+            for (std::size_t i = 0; i < commands.size(); ++i) {
+                pipe_istream next;
+                pipe_ostream downstream;
+                int child_out = out;
+                if (i + 1 < commands.size() || piped == out) {
+                    auto p = make_pipe(pipe_size);
+                    next = std::move(p.first);
+                    downstream = std::move(p.second);
+                    child_out = downstream.fd();
+                }
+                _processes.emplace_back(commands[i], in, child_out);
+                if (i + 1 < commands.size()) {
+                    upstream = std::move(next);
+                    in = upstream.fd();
+                } else {
+                    _output = std::move(next);
+                }
+                //The child's ends close here, in this process.
+            }
+        }
+
+        ~process_chain()
+        {
+            _input.close();
+            _output.close();
+        }
+
+        //The first command's standard input, if it's piped.
+        pipe_ostream& input()
+        {
+            Expects(-1 != _input.fd());
+            return _input;
+        }
+
+        //The last command's standard output, if it's piped.
+        pipe_istream& output()
+        {
+            Expects(-1 != _output.fd());
+            return _output;
+        }
+
+        //End the input, if it's piped, and wait for every command to exit.
+        //Returns their exit statuses (see subprocess::wait()).
+        std::vector<int> wait()
+        {
+            _input.close();
+            std::vector<int> statuses;
+            for (auto& p: _processes) statuses.push_back(p.wait());
+            return statuses;
+        }
+
+    private:
+        //Declared first so the pipes close before waiting on the processes.
+        std::vector<subprocess> _processes;
+        pipe_ostream _input;
+        pipe_istream _output;
+    };
+
+    //process_dispatch
+    //How process_pool_ostream picks a process for each chunk.
+    enum class process_dispatch {
+        round_robin,    //Each process in turn.
+        least_loaded    //The one with the fewest bytes still to come back.
+    };
+
+    //process_pool_options
+    struct process_pool_options {
+        //How many copies of the command to run. Zero means one per core.
+        std::ptrdiff_t processes = 0;
+        //Input goes to the processes in chunks of about this size.
+        std::ptrdiff_t chunk_size = 64 * 1024;
+        //Records end with this byte, in the input and in the output.
+        gsl::byte delimiter = gsl::byte('\n');
+        process_dispatch dispatch = process_dispatch::round_robin;
+    };
+
+    //process_pool_ostream
+    //Pipes output through several long-lived copies of a command at once,
+    //then puts what they write back in order, like GNU parallel's --pipe:
+    //
+    //  streams::process_pool_ostream out(sink, { "sed", "s/a/b/" });
+    //
+    //Written bytes are cut into chunks of whole records, and each chunk is
+    //written to one process's standard input. A thread per process reads
+    //its standard output. The command must write one output record for
+    //each input record, in order (as sed, tr, cut, and the like do), so
+    //the output can be cut back into chunks, which go to the sink in their
+    //original order through a reorder_buffer.
+    //
+    //Nothing ever waits for a chunk's output before sending more input,
+    //since the command may be holding it in its own buffer until it gets
+    //more input or reaches the end. Backpressure comes from the pipes.
+    //flush() sends the current chunk off and flushes the sink with the
+    //output that's come back so far, but can't make the processes answer;
+    //close() (or the destructor) ends their input, writes all of their
+    //output, and waits for them. A partial record at the very end gets a
+    //delimiter on the way in, which is taken off on the way out.
+    //
+    //close() throws if a process exits with a nonzero status, or writes
+    //more records than it was given. Writing throws if a process stops
+    //reading its input early, with its status.
+    class process_pool_ostream: public ostream {
+    public:
+        process_pool_ostream(
+                ostream& sink,
+                const std::vector<std::string>& argv,
+                const process_pool_options& options = process_pool_options()):
+            _sink(sink),
+            _options(defaults(options)),
+            _batcher(_pool, _options.chunk_size, _options.delimiter),
+            _reorder(sink)
+        {
+            for (std::ptrdiff_t i = 0; i < _options.processes; ++i) {
+                _children.emplace_back(new child(argv));
+            }
+            for (auto& c: _children) {
+                auto p = c.get();
+                c->reader = std::thread([this, p]() { read_output(*p); });
+            }
+        }
+
+        ~process_pool_ostream()
+        {
+            try { close(); }
+            catch (...) {}
+        }
+
+        void close()
+        {
+            if (_closed) return;
+            _closed = true;
+            std::exception_ptr error;
+            try {
+                _batcher.finish([this](buffer_pool::buffer b) {
+                        submit(std::move(b));
+                    });
+            } catch (...) {
+                error = std::current_exception();
+            }
+            for (auto& c: _children) c->in.reset();
+            for (auto& c: _children) c->reader.join();
+            int status = 0;
+            for (auto& c: _children) {
+                auto s = c->process.wait();
+                if (0 == status) status = s;
+            }
+            if (error) std::rethrow_exception(error);
+            _reorder.rethrow();
+            _sink.flush();
+            if (0 != status) throw status_error(status);
+        }
+
+    private:
+        struct Pipe {
+            unique_fd read;
+            unique_fd write;
+
+            Pipe()
+            {
+                int fds[2];
+                if (-1 == pipe2(fds, O_CLOEXEC)) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                read.reset(fds[0]);
+                write.reset(fds[1]);
+            }
+        };
+
+        //A chunk sent to a process, waiting for its output.
+        struct pending {
+            std::ptrdiff_t seq;
+            std::ptrdiff_t records;
+            std::ptrdiff_t size;
+            bool added_delimiter;
+        };
+
+        //Declared so that stdin closes before the process is waited for.
+        struct child {
+            subprocess process;
+            unique_fd in;
+            unique_fd out;
+            std::thread reader;
+            std::mutex mutex;
+            std::deque<pending> waiting;
+            //Bytes sent whose output hasn't come back.
+            std::atomic<std::ptrdiff_t> load{0};
+
+            explicit child(const std::vector<std::string>& argv):
+                child(argv, Pipe(), Pipe()) {}
+
+            child(const std::vector<std::string>& argv,
+                    Pipe&& to, Pipe&& from):
+                process(argv, to.read.get(), from.write.get()),
+                in(to.write.release()),
+                out(from.read.release())
+            {}
+
+            //close() has normally done this already, but not if the pool's
+            //constructor failed. Ending the input lets the process, and so
+            //the reader, finish.
+            ~child()
+            {
+                in.reset();
+                if (reader.joinable()) reader.join();
+            }
+        };
+
+        static std::runtime_error status_error(int status)
+        {
+            return std::runtime_error(
+                    "process_pool_ostream: command exited with status " +
+                    std::to_string(status));
+        }
+
+        static process_pool_options defaults(process_pool_options options)
+        {
+            if (options.processes <= 0) {
+                options.processes =
+                    std::max(1u, std::thread::hardware_concurrency());
+            }
+            return options;
+        }
+
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            _reorder.rethrow();
+            _batcher.add(bytes,
+                    [this](buffer_pool::buffer b) { submit(std::move(b)); });
+            return bytes.size();
+        }
+
+        void _flush() override
+        {
+            _batcher.finish(
+                    [this](buffer_pool::buffer b) { submit(std::move(b)); });
+            _reorder.rethrow();
+            //The readers may be writing to the sink.
+            _reorder.flush();
+        }
+
+        child& choose()
+        {
+            if (process_dispatch::round_robin == _options.dispatch) {
+                return *_children[_next % _children.size()];
+            }
+            return **std::min_element(_children.begin(), _children.end(),
+                    [](const std::unique_ptr<child>& a,
+                        const std::unique_ptr<child>& b) {
+                        return a->load < b->load;
+                    });
+        }
+
+        void submit(buffer_pool::buffer chunk)
+        {
+            pending p{ _next, 0, 0, false };
+            if (_options.delimiter != chunk->back()) {
+                chunk->push_back(_options.delimiter);
+                p.added_delimiter = true;
+            }
+            p.records = std::count(chunk->begin(), chunk->end(),
+                    _options.delimiter);
+            p.size = chunk->size();
+            auto& c = choose();
+            ++_next;
+            {
+                std::lock_guard<std::mutex> lock(c.mutex);
+                c.waiting.push_back(p);
+            }
+            c.load += p.size;
+            try {
+                write_to_pipe(c.in.get(), *chunk);
+            } catch (const std::system_error& e) {
+                if (EPIPE != e.code().value()) throw;
+                //The process stopped reading; say how it ended.
+                c.in.reset();
+                throw status_error(c.process.wait());
+            }
+        }
+
+        //Cut the process's output into chunks, record by record, and pass
+        //them on. At the end, whatever came back goes to whatever's left.
+        void read_output(child& c)
+        {
+            try {
+                std::vector<gsl::byte> buffer(64 * 1024);
+                buffer_pool::buffer result;
+                std::ptrdiff_t records = 0;
+                bool eof = false;
+                while (true) {
+                    auto n = ::read(c.out.get(), buffer.data(), buffer.size());
+                    if (-1 == n && EINTR == errno) continue;
+                    if (-1 == n) {
+                        throw std::system_error(errno, std::system_category());
+                    }
+                    eof = 0 == n;
+                    gsl::span<const gsl::byte> bytes(buffer.data(), n);
+                    while (bytes.size() > 0 || eof) {
+                        pending p;
+                        {
+                            std::lock_guard<std::mutex> lock(c.mutex);
+                            if (c.waiting.empty() && bytes.size() > 0) {
+                                throw std::runtime_error(
+                                        "process_pool_ostream: command "
+                                        "wrote more records than it read");
+                            }
+                            if (c.waiting.empty()) break;
+                            p = c.waiting.front();
+                        }
+                        if (!result) result = _pool.get();
+                        //Take bytes up to the end of the chunk's last record.
+                        auto end = bytes.begin();
+                        while (records < p.records && bytes.end() != end) {
+                            end = std::find(end, bytes.end(),
+                                    _options.delimiter);
+                            if (bytes.end() != end) {
+                                ++end;
+                                ++records;
+                            }
+                        }
+                        result->insert(result->end(), bytes.begin(), end);
+                        bytes = bytes.subspan(end - bytes.begin());
+                        if (records < p.records && !eof) break;
+                        if (p.added_delimiter && !result->empty() &&
+                                _options.delimiter == result->back()) {
+                            result->pop_back();
+                        }
+                        {
+                            std::lock_guard<std::mutex> lock(c.mutex);
+                            c.waiting.pop_front();
+                        }
+                        c.load -= p.size;
+                        records = 0;
+                        _reorder.put(p.seq, std::move(result));
+                        result = nullptr;
+                    }
+                    if (eof) break;
+                }
+            } catch (...) {
+                _reorder.fail(std::current_exception());
+                //Nobody's reading now, so don't let the process block
+                //writing to us.
+                c.out.reset();
+            }
+        }
+
+        ostream& _sink;
+        process_pool_options _options;
+        buffer_pool _pool;
+        record_batcher _batcher;
+        reorder_buffer _reorder;
+        std::vector<std::unique_ptr<child>> _children;
+        std::ptrdiff_t _next = 0;
+        bool _closed = false;
+    };
+}
@@ -0,0 +1,279 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+
+namespace streams {
+    //blocking_queue
+    //A bounded, thread-safe FIFO for handing work between threads.
+    //
+    //push() blocks while the queue is full and pop() blocks while it's empty.
+    //After close(), push() refuses new items and pop() returns what's left,
+    //then nullopt.
+    template<typename T>
+    class blocking_queue {
+    public:
+        explicit blocking_queue(std::ptrdiff_t capacity): _capacity(capacity)
+        { Expects(capacity > 0); }
+
+        blocking_queue(const blocking_queue&) = delete;
+        blocking_queue& operator=(const blocking_queue&) = delete;
+
+        //Returns false, without taking t, if the queue has been closed.
+        bool push(T&& t)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_full.wait(lock, [this]() {
+                    return _closed ||
+                        static_cast<std::ptrdiff_t>(_items.size()) < _capacity;
+                });
+            if (_closed) return false;
+            _items.push_back(std::move(t));
+            _not_empty.notify_one();
+            return true;
+        }
+
+        optional<T> pop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_empty.wait(lock,
+                    [this]() { return _closed || !_items.empty(); });
+            if (_items.empty()) return nullopt;
+            optional<T> t(std::move(_items.front()));
+            _items.pop_front();
+            _not_full.notify_one();
+            return t;
+        }
+
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+            _not_empty.notify_all();
+            _not_full.notify_all();
+        }
+
+    private:
+        std::ptrdiff_t _capacity;
+        std::deque<T> _items;
+        bool _closed = false;
+        std::mutex _mutex;
+        std::condition_variable _not_empty;
+        std::condition_variable _not_full;
+    };
+
+    //event_waiter
+    //Lets one thread wait for something another thread does. wait() spins
+    //for a while, since a handoff between busy threads is usually quick,
+    //and then parks on an eventfd. notify() only writes the eventfd when
+    //the waiter has parked, so busy handoffs make no system calls at all.
+    //
+    //fd() is the eventfd, for a thread that would rather wait in an event
+    //loop: park(), check the condition, and if it's still false, wait for
+    //fd() to be readable. Call unpark() before checking again.
+    //
+    //After shut(), fd() stays readable and wait() doesn't sleep, so a
+    //waiter can't miss the end, whenever it parks.
+    class event_waiter {
+    public:
+        explicit event_waiter(int spins = 1000):
+            _fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+            _spins(spins)
+        {
+            if (-1 == _fd) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        event_waiter(const event_waiter&) = delete;
+        event_waiter& operator=(const event_waiter&) = delete;
+
+        ~event_waiter() { ::close(_fd); }
+
+        int fd() const { return _fd; }
+
+        //Return once ready() is true.
+        template<typename F>
+        void wait(F ready)
+        {
+            for (int i = 0; i < _spins; ++i) {
+                if (ready()) return;
+                relax();
+            }
+            while (true) {
+                park();
+                //notify() may have come before park(), and not signalled.
+                if (ready()) break;
+                pollfd p{ _fd, POLLIN, 0 };
+                if (-1 == poll(&p, 1, -1) && EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                unpark();
+                if (ready()) return;
+            }
+            unpark();
+        }
+
+        void park() { _parked.store(true); }
+
+        //Stop waiting, and clear any signal so fd() isn't left readable.
+        void unpark()
+        {
+            _parked.store(false);
+            if (_shut.load() || !_signalled.exchange(false)) return;
+            std::uint64_t count;
+            while (-1 == ::read(_fd, &count, sizeof(count)) && EINTR == errno);
+        }
+
+        //Call after making the condition true.
+        void notify()
+        {
+            if (!_parked.load() || !_parked.exchange(false)) return;
+            _signalled.store(true);
+            signal();
+        }
+
+        //Wake the waiter for good.
+        void shut()
+        {
+            if (!_shut.exchange(true)) signal();
+        }
+
+    private:
+        void signal()
+        {
+            std::uint64_t one = 1;
+            while (-1 == ::write(_fd, &one, sizeof(one)) && EINTR == errno);
+        }
+
+        static void relax()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        }
+
+        int _fd;
+        int _spins;
+        std::atomic<bool> _parked{false};
+        std::atomic<bool> _signalled{false};
+        std::atomic<bool> _shut{false};
+    };
+
+    //spsc_queue
+    //A bounded FIFO between exactly one producer thread and one consumer
+    //thread. Items go through a ring without locking. A side that finds
+    //the ring full or empty waits with an event_waiter, so the other side
+    //only makes a system call to wake it if it has actually gone to sleep.
+    //
+    //Same interface as blocking_queue. Either side may close() it.
+    //
+    //For event loops, try_push() and try_pop() don't wait. When they fail,
+    //producer_fd() or consumer_fd() becomes readable once it's worth
+    //trying again. After close(), both stay readable.
+    template<typename T>
+    class spsc_queue {
+    public:
+        explicit spsc_queue(std::ptrdiff_t capacity, int spins = 1000):
+            _slots(capacity), _space(spins), _items(spins)
+        { Expects(capacity > 0); }
+
+        spsc_queue(const spsc_queue&) = delete;
+        spsc_queue& operator=(const spsc_queue&) = delete;
+
+        //Returns false, without taking t, if the queue has been closed.
+        bool push(T&& t)
+        {
+            auto tail = _tail.load(std::memory_order_relaxed);
+            auto full = [&]() { return tail - _head.load() >= _slots.size(); };
+            if (full()) _space.wait([&]() { return _closed || !full(); });
+            if (_closed) return false;
+            _slots[tail % _slots.size()] = std::move(t);
+            _tail.store(tail + 1);
+            _items.notify();
+            return true;
+        }
+
+        optional<T> pop()
+        {
+            auto head = _head.load(std::memory_order_relaxed);
+            auto empty = [&]() { return _tail.load() == head; };
+            if (empty()) _items.wait([&]() { return _closed || !empty(); });
+            if (empty()) return nullopt;
+            optional<T> t(std::move(_slots[head % _slots.size()]));
+            _head.store(head + 1);
+            _space.notify();
+            return t;
+        }
+
+        //Returns false, without taking t, if the queue is full or closed.
+        bool try_push(T&& t)
+        {
+            auto tail = _tail.load(std::memory_order_relaxed);
+            _space.unpark();
+            if (tail - _head.load() >= _slots.size()) {
+                _space.park();
+                if (tail - _head.load() >= _slots.size()) return false;
+                _space.unpark();
+            }
+            if (_closed) return false;
+            _slots[tail % _slots.size()] = std::move(t);
+            _tail.store(tail + 1);
+            _items.notify();
+            return true;
+        }
+
+        //nullopt if the queue is empty, or closed and empty.
+        optional<T> try_pop()
+        {
+            auto head = _head.load(std::memory_order_relaxed);
+            _items.unpark();
+            if (_tail.load() == head) {
+                _items.park();
+                if (_tail.load() == head) return nullopt;
+                _items.unpark();
+            }
+            optional<T> t(std::move(_slots[head % _slots.size()]));
+            _head.store(head + 1);
+            _space.notify();
+            return t;
+        }
+
+        void close()
+        {
+            _closed.store(true);
+            _space.shut();
+            _items.shut();
+        }
+
+        bool closed() const { return _closed.load(); }
+
+        int producer_fd() const { return _space.fd(); }
+        int consumer_fd() const { return _items.fd(); }
+
+    private:
+        std::vector<T> _slots;
+        std::atomic<std::size_t> _head{0};
+        std::atomic<std::size_t> _tail{0};
+        std::atomic<bool> _closed{false};
+        //The producer waits for space, the consumer for items.
+        event_waiter _space;
+        event_waiter _items;
+    };
+}
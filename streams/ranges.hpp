@@ -0,0 +1,298 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <experimental/string_view>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+
+#include <gsl/gsl>
+
+#include "istream.hpp"
+
+namespace streams {
+    using string_view = std::experimental::string_view;
+
+    //range_buffer
+    //The buffer behind lines(), records() and chunks(). Input is read into
+    //it in big blocks, and the ranges hand out views of it, so there's one
+    //virtual call per block rather than per element.
+    //
+    //The buffer is aligned for any type, and unconsumed bytes always move
+    //back to the start of it, so a view that starts at a multiple of
+    //sizeof(T) from the start is suitably aligned for a T.
+    class range_buffer {
+    public:
+        range_buffer(istream& in, std::ptrdiff_t capacity):
+            _in(&in),
+            _data(allocate(capacity)),
+            _capacity(capacity)
+        { Expects(capacity > 0); }
+
+        const gsl::byte* data() const
+        { return reinterpret_cast<const gsl::byte*>(_data.get()); }
+
+        //What's been read but not consumed.
+        gsl::span<const gsl::byte> available() const
+        { return { data() + _begin, _end - _begin }; }
+
+        void consume(std::ptrdiff_t n)
+        {
+            Expects(n <= _end - _begin);
+            _begin += n;
+        }
+
+        //Move what's left to the front and read more after it, growing the
+        //buffer first if what's left fills it. This invalidates views.
+        //Returns false once the input is exhausted.
+        bool refill()
+        {
+            if (_eof) return false;
+            auto left = _end - _begin;
+            auto bytes = reinterpret_cast<gsl::byte*>(_data.get());
+            if (left >= _capacity) {
+                auto capacity = 2 * _capacity;
+                auto data = allocate(capacity);
+                std::memcpy(data.get(), bytes + _begin, left);
+                _data = std::move(data);
+                _capacity = capacity;
+                bytes = reinterpret_cast<gsl::byte*>(_data.get());
+            } else if (_begin > 0) {
+                std::memmove(bytes, bytes + _begin, left);
+            }
+            _begin = 0;
+            _end = left;
+            auto got = _in->read({ bytes + _end, _capacity - _end });
+            if (0 == got.size()) {
+                _eof = true;
+                return false;
+            }
+            _end += got.size();
+            return true;
+        }
+
+    private:
+        using block = std::aligned_storage_t<
+            sizeof(std::max_align_t), alignof(std::max_align_t)>;
+
+        static std::unique_ptr<block[]> allocate(std::ptrdiff_t capacity)
+        {
+            auto blocks = (capacity + sizeof(block) - 1) / sizeof(block);
+            return std::unique_ptr<block[]>(new block[blocks]);
+        }
+
+        istream* _in;
+        std::unique_ptr<block[]> _data;
+        std::ptrdiff_t _capacity;
+        std::ptrdiff_t _begin = 0;
+        std::ptrdiff_t _end = 0;
+        bool _eof = false;
+    };
+
+    //range_iterator
+    //An input iterator over any of the ranges below. Each range provides
+    //next(), which advances to the next element and returns false at the
+    //end, and value(), which returns the current element.
+    template<typename Range, typename Value, typename Reference>
+    class range_iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Value;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::add_pointer_t<std::remove_reference_t<Reference>>;
+        using reference = Reference;
+
+        //For *it++, which has to return the element it was on.
+        class postfix {
+        public:
+            explicit postfix(Value v): _v(std::move(v)) {}
+            const Value& operator*() const { return _v; }
+        private:
+            Value _v;
+        };
+
+        range_iterator() {}
+        explicit range_iterator(Range* range): _range(range) { ++*this; }
+
+        reference operator*() const { return _range->value(); }
+        pointer operator->() const { return &_range->value(); }
+
+        range_iterator& operator++()
+        {
+            if (!_range->next()) _range = nullptr;
+            return *this;
+        }
+
+        postfix operator++(int)
+        {
+            postfix p(**this);
+            ++*this;
+            return p;
+        }
+
+        friend bool operator==(
+                const range_iterator& a, const range_iterator& b)
+        { return a._range == b._range; }
+
+        friend bool operator!=(
+                const range_iterator& a, const range_iterator& b)
+        { return a._range != b._range; }
+
+    private:
+        Range* _range = nullptr;
+    };
+
+    //line_range
+    //See lines().
+    class line_range {
+    public:
+        using iterator = range_iterator<line_range, string_view,
+              const string_view&>;
+
+        line_range(istream& in, char nl, std::ptrdiff_t buffer_size):
+            _buffer(in, buffer_size), _nl(nl) {}
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        const string_view& value() const { return _line; }
+
+        bool next()
+        {
+            while (true) {
+                auto a = _buffer.available();
+                auto start = reinterpret_cast<const char*>(a.data());
+                auto found = static_cast<const char*>(std::memchr(
+                            start + _scanned, _nl, a.size() - _scanned));
+                if (found) {
+                    _line = string_view(start, found - start);
+                    _buffer.consume(found - start + 1);
+                    _scanned = 0;
+                    return true;
+                }
+                _scanned = a.size();
+                if (!_buffer.refill()) break;
+            }
+            //The last line doesn't need a newline.
+            auto a = _buffer.available();
+            if (0 == a.size()) return false;
+            _line = string_view(reinterpret_cast<const char*>(a.data()),
+                    a.size());
+            _buffer.consume(a.size());
+            _scanned = 0;
+            return true;
+        }
+
+    private:
+        range_buffer _buffer;
+        char _nl;
+        std::ptrdiff_t _scanned = 0;
+        string_view _line;
+    };
+
+    //record_range
+    //See records().
+    template<typename T>
+    class record_range {
+    public:
+        static_assert(std::is_trivially_copyable<T>::value,
+                "records() only works with trivially copyable types.");
+
+        using iterator = range_iterator<record_range, T, const T&>;
+
+        record_range(istream& in, std::ptrdiff_t buffer_size):
+            _buffer(in, std::max<std::ptrdiff_t>(buffer_size, sizeof(T))) {}
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        const T& value() const { return *_record; }
+
+        bool next()
+        {
+            auto size = static_cast<std::ptrdiff_t>(sizeof(T));
+            while (_buffer.available().size() < size) {
+                //A partial record at the end is dropped, as get() would.
+                if (!_buffer.refill()) return false;
+            }
+            _record = reinterpret_cast<const T*>(_buffer.available().data());
+            _buffer.consume(size);
+            return true;
+        }
+
+    private:
+        range_buffer _buffer;
+        const T* _record = nullptr;
+    };
+
+    //chunk_range
+    //See chunks().
+    class chunk_range {
+    public:
+        using iterator = range_iterator<chunk_range,
+              gsl::span<const gsl::byte>, const gsl::span<const gsl::byte>&>;
+
+        chunk_range(istream& in, std::ptrdiff_t n, std::ptrdiff_t buffer_size):
+            _buffer(in, capacity(n, buffer_size)), _n(n) {}
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        const gsl::span<const gsl::byte>& value() const { return _chunk; }
+
+        bool next()
+        {
+            while (_buffer.available().size() < _n) {
+                if (_buffer.refill()) continue;
+                //The last chunk can be short.
+                if (0 == _buffer.available().size()) return false;
+                break;
+            }
+            auto a = _buffer.available();
+            _chunk = a.first(std::min(a.size(), _n));
+            _buffer.consume(_chunk.size());
+            return true;
+        }
+
+    private:
+        //A whole number of chunks.
+        static std::ptrdiff_t capacity(std::ptrdiff_t n, std::ptrdiff_t size)
+        {
+            Expects(n > 0);
+            return std::max(n, size / n * n);
+        }
+
+        range_buffer _buffer;
+        std::ptrdiff_t _n;
+        gsl::span<const gsl::byte> _chunk;
+    };
+
+    //lines
+    //Each line of the input, without its newline, for range-based for
+    //loops and standard algorithms:
+    //
+    //  for (auto line: streams::lines(in)) count += line.size();
+    //
+    //The lines are views into the range's buffer. Each one stays valid
+    //until the iterator is incremented; copy it to keep it.
+    line_range lines(
+            istream& in, char nl = '\n', std::ptrdiff_t buffer_size = 64 * 1024)
+    { return line_range(in, nl, buffer_size); }
+
+    //records
+    //Each T in a stream of binary T's, as const T&, read straight from the
+    //range's buffer without copying. References last until the next
+    //increment.
+    template<typename T>
+    record_range<T> records(
+            istream& in, std::ptrdiff_t buffer_size = 64 * 1024)
+    { return record_range<T>(in, buffer_size); }
+
+    //chunks
+    //The input as spans of n bytes (the last may be shorter), viewing the
+    //range's buffer. Spans last until the next increment.
+    chunk_range chunks(
+            istream& in, std::ptrdiff_t n, std::ptrdiff_t buffer_size = 64 * 1024)
+    { return chunk_range(in, n, buffer_size); }
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+
+namespace streams {
+    //reverse_block_reader
+    //Reads a file from its end toward its start in large blocks.
+    //
+    //Every block except the one at the very end of the file starts and ends
+    //on a multiple of block_size, so the reads stay aligned with the page
+    //cache. Nothing before the blocks you ask for is ever read.
+    class reverse_block_reader {
+    public:
+        explicit reverse_block_reader(
+                const std::string& path, std::ptrdiff_t block_size = 1 << 20):
+            _fd(open(path.c_str(), O_RDONLY)), _buffer(block_size)
+        {
+            Expects(block_size > 0);
+            if (-1 == _fd.get()) {
+                throw std::system_error(errno, std::system_category());
+            }
+            struct stat info;
+            if (-1 == fstat(_fd.get(), &info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            _offset = info.st_size;
+            posix_fadvise(_fd.get(), 0, 0, POSIX_FADV_RANDOM);
+        }
+
+        reverse_block_reader(const reverse_block_reader&) = delete;
+        reverse_block_reader& operator=(const reverse_block_reader&) = delete;
+
+        //Read the block just before the last one returned.
+        //Returns an empty span once the start of the file has been reached.
+        //The span is only valid until the next call.
+        gsl::span<gsl::byte> previous_block()
+        {
+            if (0 == _offset) return {};
+            std::ptrdiff_t block_size = _buffer.size();
+            auto start = ((_offset - 1) / block_size) * block_size;
+            auto block = gsl::span<gsl::byte>(_buffer).first(_offset - start);
+            auto unread = block;
+            while (unread.size() > 0) {
+                auto bytes_read = pread(_fd.get(), unread.data(), unread.size(),
+                        start + (block.size() - unread.size()));
+                if (-1 == bytes_read) {
+                    if (EINTR == errno) continue;
+                    throw std::system_error(errno, std::system_category());
+                }
+                if (0 == bytes_read) {
+                    throw read_error("File shrank while reading backwards");
+                }
+                unread = unread.subspan(bytes_read);
+            }
+            _offset = start;
+            return block;
+        }
+
+        //File offset of the start of the last block returned.
+        std::ptrdiff_t offset() const { return _offset; }
+
+    private:
+        unique_fd _fd;
+        std::vector<gsl::byte> _buffer;
+        std::ptrdiff_t _offset = 0;
+    };
+
+    //reverse_istream
+    //Reads the bytes of a file in reverse order, last byte first.
+    class reverse_istream: public istream {
+    public:
+        explicit reverse_istream(
+                const std::string& path, std::ptrdiff_t block_size = 1 << 20):
+            _reader(path, block_size) {}
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> s) override
+        {
+            auto original_span = s;
+            std::ptrdiff_t bytes_delivered = 0;
+            while (s.size() > 0) {
+                if (_available.size() <= 0) {
+                    _available = _reader.previous_block();
+                    if (_available.size() <= 0) break;
+                }
+                auto to_copy = std::min(s.size(), _available.size());
+                auto keep = _available.size() - to_copy;
+                std::reverse_copy(_available.begin() + keep, _available.end(),
+                        s.begin());
+                _available = _available.first(keep);
+                s = s.subspan(to_copy);
+                bytes_delivered += to_copy;
+            }
+            return original_span.first(bytes_delivered);
+        }
+
+        reverse_block_reader _reader;
+        gsl::span<gsl::byte> _available;
+    };
+
+    //reverse_lines
+    //The lines of a file, last line first, without scanning the whole file:
+    //
+    //  int n = 0;
+    //  for (const auto& line: streams::reverse_lines("huge.log")) {
+    //      if (++n > 1000) break;
+    //      ...
+    //  }
+    //
+    //Only the blocks holding the lines you visit are read. Newlines are found
+    //with memrchr(), which the C library vectorizes.
+    //
+    //A newline at the very end of the file doesn't start an empty last line.
+    class reverse_lines {
+    public:
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::string;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string*;
+            using reference = const std::string&;
+
+            iterator() {}
+            explicit iterator(reverse_lines* lines):
+                _lines(lines), _line(lines->next())
+            { if (!_line) _lines = nullptr; }
+
+            reference operator*() const { return *_line; }
+            pointer operator->() const { return &*_line; }
+
+            iterator& operator++()
+            {
+                _line = _lines->next();
+                if (!_line) _lines = nullptr;
+                return *this;
+            }
+
+            void operator++(int) { ++*this; }
+
+            bool operator==(const iterator& other) const
+            { return _lines == other._lines; }
+
+            bool operator!=(const iterator& other) const
+            { return !(*this == other); }
+
+        private:
+            reverse_lines* _lines = nullptr;
+            optional<std::string> _line;
+        };
+
+        explicit reverse_lines(
+                const std::string& path,
+                char nl = '\n',
+                std::ptrdiff_t block_size = 1 << 20):
+            _reader(path, block_size), _nl(nl)
+        {
+            if (!load_previous_block()) {
+                _done = true;
+                return;
+            }
+            if (gsl::byte(_nl) == _window[_line_end - 1]) --_line_end;
+        }
+
+        reverse_lines(const reverse_lines&) = delete;
+        reverse_lines& operator=(const reverse_lines&) = delete;
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        //The next line, working backwards, or nullopt at the start of the
+        //file.
+        optional<std::string> next()
+        {
+            if (_done) return nullopt;
+            while (true) {
+                auto data = reinterpret_cast<const char*>(_window.data());
+                auto p = static_cast<const char*>(
+                        memrchr(data, _nl, _line_end));
+                if (p) {
+                    std::string line(p + 1, data + _line_end);
+                    _line_end = p - data;
+                    return line;
+                }
+                if (!load_previous_block()) {
+                    _done = true;
+                    return std::string(data, _line_end);
+                }
+            }
+        }
+
+    private:
+        //Put the previous block in front of the part of the window that
+        //hasn't been returned yet.
+        bool load_previous_block()
+        {
+            auto block = _reader.previous_block();
+            if (block.size() <= 0) return false;
+            std::vector<gsl::byte> window;
+            window.reserve(block.size() + _line_end);
+            window.insert(window.end(), block.begin(), block.end());
+            window.insert(window.end(),
+                    _window.begin(), _window.begin() + _line_end);
+            _window.swap(window);
+            _line_end = _window.size();
+            return true;
+        }
+
+        reverse_block_reader _reader;
+        char _nl;
+        std::vector<gsl::byte> _window;
+        std::ptrdiff_t _line_end = 0;
+        bool _done = false;
+    };
+}
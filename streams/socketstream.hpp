@@ -0,0 +1,476 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+
+namespace streams {
+    //tcp_socket
+    //Owns a connected TCP socket. Write to it with a tcp_ostream and read
+    //from it with a tcp_istream.
+    class tcp_socket {
+    public:
+        explicit tcp_socket(int fd = -1): _fd(fd) {}
+
+        tcp_socket(tcp_socket&& other) noexcept:
+            _fd(std::exchange(other._fd, -1)) {}
+
+        tcp_socket& operator=(tcp_socket&& other) noexcept
+        {
+            std::swap(_fd, other._fd);
+            return *this;
+        }
+
+        ~tcp_socket() { close(); }
+
+        int fd() { return _fd; }
+
+        //Send small writes at once instead of waiting to fill a segment.
+        void set_nodelay(bool on) { set(IPPROTO_TCP, TCP_NODELAY, on); }
+
+        //Hold back partial segments until uncorked (or 200ms pass). A
+        //tcp_ostream's flush() pushes them out.
+        void set_cork(bool on) { set(IPPROTO_TCP, TCP_CORK, on); }
+
+        //Don't wake a reader until this many bytes have arrived.
+        void set_low_water(int bytes) { set(SOL_SOCKET, SO_RCVLOWAT, bytes); }
+
+        //Tell the peer there's no more to read, but keep reading.
+        void shutdown_write()
+        {
+            if (-1 == ::shutdown(_fd, SHUT_WR)) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        void close()
+        {
+            if (-1 != _fd) ::close(_fd);
+            _fd = -1;
+        }
+
+    private:
+        void set(int level, int option, int value)
+        {
+            if (-1 == setsockopt(_fd, level, option, &value, sizeof(value))) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+
+        int _fd;
+    };
+
+    //tcp_addresses
+    //getaddrinfo() for TCP, with the results freed when this goes away.
+    class tcp_addresses {
+    public:
+        tcp_addresses(const std::string& host, int port, int flags = 0)
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = flags | AI_NUMERICSERV;
+            auto service = std::to_string(port);
+            auto error = getaddrinfo(host.empty()? nullptr: host.c_str(),
+                    service.c_str(), &hints, &_list);
+            if (0 != error) throw std::runtime_error(gai_strerror(error));
+        }
+
+        tcp_addresses(const tcp_addresses&) = delete;
+        tcp_addresses& operator=(const tcp_addresses&) = delete;
+
+        ~tcp_addresses() { freeaddrinfo(_list); }
+
+        //Call f with a socket for each address until it returns true.
+        //Returns that socket. Throws the last error if none worked.
+        template<typename F>
+        tcp_socket first(F f)
+        {
+            int error = EADDRNOTAVAIL;
+            for (auto a = _list; a; a = a->ai_next) {
+                tcp_socket s(socket(a->ai_family,
+                            a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol));
+                if (-1 == s.fd() || !f(s.fd(), a)) {
+                    error = errno;
+                    continue;
+                }
+                return s;
+            }
+            throw std::system_error(error, std::system_category());
+        }
+
+    private:
+        addrinfo* _list = nullptr;
+    };
+
+    //tcp_connect
+    //Connect to host:port, trying each of its addresses in turn.
+    tcp_socket tcp_connect(const std::string& host, int port)
+    {
+        tcp_addresses addresses(host, port);
+        return addresses.first([](int fd, addrinfo* a) {
+                int r;
+                do r = ::connect(fd, a->ai_addr, a->ai_addrlen);
+                while (-1 == r && EINTR == errno);
+                return 0 == r;
+            });
+    }
+
+    //tcp_listener
+    //Listens on address:port. With port 0 the kernel picks a free port,
+    //which port() reports; handy for tests over 127.0.0.1.
+    class tcp_listener {
+    public:
+        explicit tcp_listener(const std::string& address = "127.0.0.1",
+                int port = 0, int backlog = SOMAXCONN)
+        {
+            tcp_addresses addresses(address, port, AI_PASSIVE);
+            _socket = addresses.first([backlog](int fd, addrinfo* a) {
+                    int on = 1;
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                    return 0 == ::bind(fd, a->ai_addr, a->ai_addrlen)
+                        && 0 == ::listen(fd, backlog);
+                });
+        }
+
+        int fd() { return _socket.fd(); }
+
+        int port()
+        {
+            sockaddr_storage address;
+            socklen_t size = sizeof(address);
+            auto sa = reinterpret_cast<sockaddr*>(&address);
+            if (-1 == getsockname(fd(), sa, &size)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (AF_INET6 == address.ss_family) {
+                return ntohs(reinterpret_cast<sockaddr_in6*>(sa)->sin6_port);
+            }
+            return ntohs(reinterpret_cast<sockaddr_in*>(sa)->sin_port);
+        }
+
+        //Wait for the next connection.
+        tcp_socket accept()
+        {
+            while (true) {
+                auto fd = accept4(this->fd(), nullptr, nullptr, SOCK_CLOEXEC);
+                if (-1 != fd) return tcp_socket(fd);
+                if (EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+            }
+        }
+
+    private:
+        tcp_socket _socket;
+    };
+
+    //tcp_ostream
+    //Writes to a TCP socket that it doesn't own, with sendmsg(), so
+    //write_gather() sends many spans per system call. Writes never raise
+    //SIGPIPE; a closed peer is an exception instead.
+    //
+    //If zerocopy_threshold is more than zero, give() sends vectors at least
+    //that big with MSG_ZEROCOPY: the kernel sends from the vector's pages
+    //instead of copying them, so the vector is held until the kernel says
+    //it's done with them. flush() and the destructor wait for that, so
+    //destroy the ostream before closing the socket. Over loopback the
+    //kernel copies anyway, but the bookkeeping is the same.
+    class tcp_ostream: public posix_base_ostream<tcp_ostream> {
+    public:
+        explicit tcp_ostream(int fd, std::ptrdiff_t zerocopy_threshold = 0):
+            _fd(fd), _zerocopy_threshold(zerocopy_threshold)
+        {
+            int on = 1;
+            //Kernels before 4.14 don't have it; give() just copies.
+            if (_zerocopy_threshold > 0 && -1 == setsockopt(
+                        _fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))) {
+                _zerocopy_threshold = 0;
+            }
+        }
+
+        ~tcp_ostream()
+        {
+            try { wait_for_zerocopy(_next_id); }
+            catch (...) {}
+        }
+
+        tcp_ostream(const tcp_ostream&) = delete;
+        tcp_ostream& operator=(const tcp_ostream&) = delete;
+
+        int fd() { return _fd; }
+
+        //Send all the spans, as few sendmsg() calls as possible.
+        std::ptrdiff_t write_gather(
+                gsl::span<const gsl::span<const gsl::byte>> spans)
+        {
+            std::ptrdiff_t total = 0;
+            while (spans.size() > 0) {
+                iovec iov[64];
+                int count = std::min<std::ptrdiff_t>(spans.size(), 64);
+                for (int i = 0; i < count; ++i) {
+                    iov[i].iov_base = const_cast<gsl::byte*>(spans[i].data());
+                    iov[i].iov_len = spans[i].size();
+                }
+                spans = spans.subspan(count);
+                total += send(iov, count, 0);
+            }
+            return total;
+        }
+
+        //Send the vector, without copying it if it's big enough.
+        void give(std::vector<gsl::byte> bytes)
+        {
+            reap_zerocopy();
+            auto size = static_cast<std::ptrdiff_t>(bytes.size());
+            if (0 == _zerocopy_threshold || size < _zerocopy_threshold) {
+                _write(bytes);
+                return;
+            }
+            iovec iov{ bytes.data(), bytes.size() };
+            send(&iov, 1, MSG_ZEROCOPY);
+            _held.push_back({ std::move(bytes), _next_id });
+        }
+
+        //How many given bytes the kernel may still be sending from.
+        std::ptrdiff_t held() const
+        {
+            std::ptrdiff_t n = 0;
+            for (auto& h: _held) n += h.bytes.size();
+            return n;
+        }
+
+    private:
+        struct held_bytes {
+            std::vector<gsl::byte> bytes;
+            //The id after the last zerocopy send of these bytes.
+            std::uint32_t end;
+        };
+
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            iovec iov{ const_cast<gsl::byte*>(bytes.data()),
+                static_cast<std::size_t>(bytes.size()) };
+            return send(&iov, 1, 0);
+        }
+
+        //Push out anything TCP_CORK is holding back, and wait for zerocopy
+        //sends to finish. Sockets can't be fsync()ed.
+        void _flush() override
+        {
+            int corked = 0;
+            socklen_t size = sizeof(corked);
+            getsockopt(_fd, IPPROTO_TCP, TCP_CORK, &corked, &size);
+            if (corked) {
+                int off = 0;
+                setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+                setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &corked, size);
+            }
+            wait_for_zerocopy(_next_id);
+        }
+
+        //sendmsg() until it's all gone. Every successful MSG_ZEROCOPY call
+        //gets the next id, which its completion will report.
+        std::ptrdiff_t send(iovec* iov, int count, int flags)
+        {
+            std::ptrdiff_t total = 0;
+            while (true) {
+                while (count > 0 && 0 == iov->iov_len) {
+                    ++iov;
+                    --count;
+                }
+                if (0 == count) break;
+                msghdr message{};
+                message.msg_iov = iov;
+                message.msg_iovlen = count;
+                auto sent = sendmsg(_fd, &message, flags | MSG_NOSIGNAL);
+                if (-1 == sent) {
+                    if (EINTR == errno) continue;
+                    //Too much zerocopy memory pinned; wait for some back.
+                    if (ENOBUFS == errno && (flags & MSG_ZEROCOPY)
+                            && _done != _next_id) {
+                        wait_for_zerocopy(_done + 1);
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category());
+                }
+                if (flags & MSG_ZEROCOPY) ++_next_id;
+                total += sent;
+                std::size_t n = sent;
+                while (n > 0) {
+                    auto step = std::min(n, iov->iov_len);
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + step;
+                    iov->iov_len -= step;
+                    n -= step;
+                    if (0 == iov->iov_len) {
+                        ++iov;
+                        --count;
+                    }
+                }
+            }
+            return total;
+        }
+
+        //Read completions from the socket's error queue without waiting.
+        //Each one covers a range of ids. They can arrive out of order, so
+        //ranges past _done wait in _early until the gap fills.
+        void reap_zerocopy()
+        {
+            while (_done != _next_id) {
+                char control[128];
+                msghdr message{};
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                if (-1 == recvmsg(_fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT)) {
+                    if (EINTR == errno) continue;
+                    if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+                    throw std::system_error(errno, std::system_category());
+                }
+                for (auto c = CMSG_FIRSTHDR(&message); c;
+                        c = CMSG_NXTHDR(&message, c)) {
+                    bool recverr = (SOL_IP == c->cmsg_level
+                            && IP_RECVERR == c->cmsg_type)
+                        || (SOL_IPV6 == c->cmsg_level
+                                && IPV6_RECVERR == c->cmsg_type);
+                    if (!recverr) continue;
+                    sock_extended_err error;
+                    std::memcpy(&error, CMSG_DATA(c), sizeof(error));
+                    if (SO_EE_ORIGIN_ZEROCOPY != error.ee_origin) continue;
+                    _early[error.ee_info] = error.ee_data + 1;
+                }
+                for (auto i = _early.find(_done); i != _early.end();
+                        i = _early.find(_done)) {
+                    _done = i->second;
+                    _early.erase(i);
+                }
+            }
+            while (!_held.empty() && ended(_held.front().end)) {
+                _held.pop_front();
+            }
+        }
+
+        //Has the kernel finished with every id before end?
+        bool ended(std::uint32_t end) const
+        { return static_cast<std::int32_t>(_done - end) >= 0; }
+
+        //POLLERR says the error queue has something in it.
+        void wait_for_zerocopy(std::uint32_t end)
+        {
+            reap_zerocopy();
+            while (!ended(end)) {
+                pollfd p{ _fd, 0, 0 };
+                if (-1 == poll(&p, 1, -1) && EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                reap_zerocopy();
+            }
+        }
+
+        int _fd;
+        std::ptrdiff_t _zerocopy_threshold;
+        std::uint32_t _next_id = 0;
+        std::uint32_t _done = 0;
+        std::map<std::uint32_t, std::uint32_t> _early;
+        std::deque<held_bytes> _held;
+    };
+
+    //tcp_istream
+    //Reads from a TCP socket that it doesn't own. read() fills the whole
+    //span unless the peer shuts down first, like any istream, with one
+    //MSG_WAITALL recv() in the usual case.
+    //
+    //receive() is for bulk readers that would rather take whatever has
+    //arrived: one system call returns everything that's queued (up to the
+    //buffers' size), after waiting for the socket's low water mark.
+    class tcp_istream: public posix_base_istream<tcp_istream> {
+    public:
+        explicit tcp_istream(int fd): _fd(fd) {}
+
+        int fd() { return _fd; }
+
+        //Empty at end of input.
+        gsl::span<gsl::byte> receive(gsl::span<gsl::byte> bytes)
+        {
+            gsl::span<gsl::byte> spans[] = { bytes };
+            return bytes.first(receive(spans));
+        }
+
+        //Scatter what's arrived across spans, 64 at a time. Only the first
+        //recvmsg() waits; if it fills its spans, the rest take what's
+        //already queued. Returns the number of bytes; 0 at end of input.
+        std::ptrdiff_t receive(gsl::span<gsl::span<gsl::byte>> spans)
+        {
+            std::ptrdiff_t total = 0;
+            int flags = 0;
+            while (spans.size() > 0) {
+                iovec iov[64];
+                int count = std::min<std::ptrdiff_t>(spans.size(), 64);
+                std::ptrdiff_t room = 0;
+                for (int i = 0; i < count; ++i) {
+                    iov[i].iov_base = spans[i].data();
+                    iov[i].iov_len = spans[i].size();
+                    room += spans[i].size();
+                }
+                spans = spans.subspan(count);
+                auto n = recv(iov, count, flags);
+                if (-1 == n) break;
+                total += n;
+                if (n < room) break;
+                flags = MSG_DONTWAIT;
+            }
+            return total;
+        }
+
+    private:
+        gsl::span<gsl::byte> _read(gsl::span<gsl::byte> bytes) override
+        {
+            std::ptrdiff_t total = 0;
+            while (total < bytes.size()) {
+                iovec iov{ bytes.data() + total,
+                    static_cast<std::size_t>(bytes.size() - total) };
+                auto n = recv(&iov, 1, MSG_WAITALL);
+                if (0 == n) break;
+                total += n;
+            }
+            return bytes.first(total);
+        }
+
+        std::ptrdiff_t recv(iovec* iov, int count, int flags)
+        {
+            msghdr message{};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            while (true) {
+                auto n = recvmsg(_fd, &message, flags);
+                if (-1 != n) return n;
+                //Nothing more queued for a MSG_DONTWAIT receive().
+                if (EAGAIN == errno && (flags & MSG_DONTWAIT)) return -1;
+                if (EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+            }
+        }
+
+        int _fd;
+    };
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "ostream.hpp"
+
+namespace streams {
+    //vmsplice_ostream
+    //Writes to a pipe, and can hand memory to the pipe with vmsplice()
+    //instead of copying it in. The reader's read() then copies straight
+    //out of that memory, so a big in-memory result reaches a child
+    //process with one copy instead of two:
+    //
+    //  auto p = streams::make_pipe(1 << 20);
+    //  streams::subprocess zstd({ "zstd", "-o", "out.zst" }, p.first.fd());
+    //  p.first.close();
+    //  streams::vmsplice_ostream out(p.second.fd());
+    //  out.give(std::move(results.vector()));
+    //  out.drain();
+    //
+    //The pipe holds references to the pages, not copies, so the memory
+    //must not change until the reader has read it. give() takes ownership
+    //of a vector and keeps it until then; lend() waits for it before
+    //returning. What's been read is worked out from FIONREAD, so this must
+    //be the only writer to the pipe.
+    //
+    //The reader must read() the pipe. A reader that splice()s or tee()s
+    //out of it takes references to the pages with it, and they can still
+    //be in use after FIONREAD says they've left the pipe. Use write() for
+    //those readers.
+    //
+    //If the reader has gone, writing throws EPIPE rather than raising
+    //SIGPIPE.
+    //
+    //Plain write()s are copied, as by posix_fd_ostream. If the fd isn't a
+    //pipe, everything is copied. It isn't a posix_base_ostream, because
+    //copy() would splice in bytes behind its back.
+    class vmsplice_ostream: public ostream {
+    public:
+        explicit vmsplice_ostream(int fd): _fd(fd) {}
+
+        //Output after anything still buffered in out.
+        explicit vmsplice_ostream(stdio_pipe_ostream& out):
+            _fd(fileno(out.file()))
+        { out.flush(); }
+
+        //The pipe may still point into the vectors we hold.
+        ~vmsplice_ostream()
+        {
+            try { drain(); }
+            catch (...) {}
+        }
+
+        vmsplice_ostream(const vmsplice_ostream&) = delete;
+        vmsplice_ostream& operator=(const vmsplice_ostream&) = delete;
+
+        int fd() { return _fd; }
+
+        //Splice the vector's bytes into the pipe. The vector is kept until
+        //they've been read.
+        void give(std::vector<gsl::byte> bytes)
+        {
+            release();
+            if (bytes.empty()) return;
+            splice(bytes);
+            if (_spliceable) _held.push_back({ std::move(bytes), _queued });
+        }
+
+        //Give away everything out has collected, leaving it empty.
+        void give(vector_ostream& out)
+        {
+            std::vector<gsl::byte> bytes;
+            bytes.swap(out.vector());
+            give(std::move(bytes));
+        }
+
+        //Splice bytes the caller owns, such as a span_istream's or a
+        //mapping's, and wait until they've been read.
+        void lend(gsl::span<const gsl::byte> bytes)
+        {
+            if (bytes.size() <= 0) return;
+            splice(bytes);
+            wait_for(_queued);
+        }
+
+        //Wait until everything given has been read and free it.
+        void drain()
+        {
+            if (!_held.empty()) wait_for(_held.back().end);
+        }
+
+        //How many given bytes the pipe may still point into.
+        std::ptrdiff_t held() const
+        {
+            std::ptrdiff_t n = 0;
+            for (auto& h: _held) n += h.bytes.size();
+            return n;
+        }
+
+    private:
+        struct held_bytes {
+            std::vector<gsl::byte> bytes;
+            //Where they end in the stream of bytes sent to the pipe.
+            std::ptrdiff_t end;
+        };
+
+        std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+        {
+            release();
+            auto n = copy_in(bytes);
+            _queued += n;
+            return n;
+        }
+
+        //There's nothing to flush, but this is a good time to free what's
+        //been read.
+        void _flush() override { release(); }
+
+        std::ptrdiff_t copy_in(gsl::span<const gsl::byte> bytes)
+        {
+            write_to_pipe(_fd, bytes);
+            return bytes.size();
+        }
+
+        void splice(gsl::span<const gsl::byte> bytes)
+        {
+            sigpipe_guard guard;
+            while (_spliceable && bytes.size() > 0) {
+                iovec iov{ const_cast<gsl::byte*>(bytes.data()),
+                    static_cast<std::size_t>(bytes.size()) };
+                auto n = vmsplice(_fd, &iov, 1, 0);
+                if (-1 == n) {
+                    if (EINTR == errno) continue;
+                    //Not a pipe, or no vmsplice().
+                    if (EBADF == errno || EINVAL == errno || ENOSYS == errno) {
+                        _spliceable = false;
+                        break;
+                    }
+                    throw std::system_error(errno, std::system_category());
+                }
+                _queued += n;
+                bytes = bytes.subspan(n);
+            }
+            _queued += copy_in(bytes);
+        }
+
+        //Everything sent minus what's still in the pipe has been read.
+        std::ptrdiff_t consumed()
+        {
+            int unread = 0;
+            if (-1 == ioctl(_fd, FIONREAD, &unread)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return _queued - unread;
+        }
+
+        void release()
+        {
+            if (_held.empty()) return;
+            auto done = consumed();
+            while (!_held.empty() && _held.front().end <= done) {
+                _held.pop_front();
+            }
+        }
+
+        //No event says a pipe has been read this far, so poll FIONREAD,
+        //backing off. POLLERR means the reader is gone and won't read
+        //anything.
+        void wait_for(std::ptrdiff_t end)
+        {
+            if (!_spliceable) return;
+            auto pause = std::chrono::microseconds(10);
+            while (consumed() < end) {
+                pollfd p{ _fd, 0, 0 };
+                if (poll(&p, 1, 0) > 0 && (p.revents & POLLERR)) break;
+                std::this_thread::sleep_for(pause);
+                pause = std::min(pause * 2, decltype(pause)(1000));
+            }
+            while (!_held.empty() && _held.front().end <= end) {
+                _held.pop_front();
+            }
+        }
+
+        int _fd;
+        bool _spliceable = true;
+        std::ptrdiff_t _queued = 0;
+        std::deque<held_bytes> _held;
+    };
+}
@@ -1,10 +1,95 @@
 #pragma once
+#include <cstddef>
+#include <utility>
 #include <gsl/gsl>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace streams {
     template<typename T>
         constexpr std::ptrdiff_t size(const T& t) { return t.size(); }
 
+    //unique_fd
+    //Owns a file descriptor, and closes it when destroyed. It can be moved
+    //but not copied, so a descriptor is only ever closed once.
+    class unique_fd {
+    public:
+        explicit unique_fd(int fd = -1): _fd(fd) {}
+
+        unique_fd(unique_fd&& other) noexcept:
+            _fd(std::exchange(other._fd, -1)) {}
+
+        unique_fd& operator=(unique_fd&& other) noexcept
+        {
+            std::swap(_fd, other._fd);
+            return *this;
+        }
+
+        ~unique_fd() { reset(); }
+
+        int get() const { return _fd; }
+
+        //Close the descriptor, if there is one, and take fd instead.
+        void reset(int fd = -1)
+        {
+            if (-1 != _fd) ::close(_fd);
+            _fd = fd;
+        }
+
+        //Give up the descriptor without closing it.
+        int release() { return std::exchange(_fd, -1); }
+
+    private:
+        int _fd;
+    };
+
+    //unique_mmap
+    //Owns a memory mapping, and unmaps it when destroyed. Like unique_fd,
+    //it can be moved but not copied.
+    class unique_mmap {
+    public:
+        unique_mmap() {}
+
+        unique_mmap(void* p, std::size_t size):
+            _p(static_cast<gsl::byte*>(p)), _s(size) {}
+
+        unique_mmap(unique_mmap&& other) noexcept:
+            _p(std::exchange(other._p, nullptr)),
+            _s(std::exchange(other._s, 0)) {}
+
+        unique_mmap& operator=(unique_mmap&& other) noexcept
+        {
+            std::swap(_p, other._p);
+            std::swap(_s, other._s);
+            return *this;
+        }
+
+        ~unique_mmap() { reset(); }
+
+        gsl::byte* data() const { return _p; }
+        std::size_t size() const { return _s; }
+
+        //Unmap, and take over the mapping at p, if given.
+        void reset(void* p = nullptr, std::size_t size = 0)
+        {
+            if (_p) munmap(_p, _s);
+            _p = static_cast<gsl::byte*>(p);
+            _s = size;
+        }
+
+        //Give up the mapping without unmapping it, as when mremap() has
+        //moved it.
+        void release()
+        {
+            _p = nullptr;
+            _s = 0;
+        }
+
+    private:
+        gsl::byte* _p = nullptr;
+        std::size_t _s = 0;
+    };
+
     struct seek_error: public std::runtime_error {
         using std::runtime_error::runtime_error;
     };
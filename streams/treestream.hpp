@@ -0,0 +1,258 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "istream.hpp"
+#include "mmapstream.hpp"
+#include "filestream.hpp"
+#include "queue.hpp"
+
+namespace streams {
+    //tree_order
+    //How read_tree() hands files to the callback.
+    enum class tree_order {
+        unordered,  //Concurrently on worker threads, as soon as they're ready.
+        ordered     //One at a time on the calling thread, in path order.
+    };
+
+    //tree_reader
+    //The threads and queues behind read_tree().
+    class tree_reader {
+    public:
+        using callback = std::function<void(const std::string&, istream&)>;
+
+        tree_reader(
+                callback f,
+                tree_order order,
+                std::ptrdiff_t workers,
+                std::ptrdiff_t io_threads,
+                std::ptrdiff_t depth):
+            _f(std::move(f)),
+            _order(order),
+            _workers(workers),
+            _io_threads(io_threads),
+            _to_open(depth),
+            _in_order(depth),
+            _ready(depth)
+        {
+            Expects(workers > 0 && io_threads > 0);
+        }
+
+        void run(const std::string& root)
+        {
+            std::vector<std::thread> threads;
+            _openers_left = _io_threads;
+            threads.emplace_back(
+                    [this, root]() { guard([&]() { walk_all(root); }); });
+            for (std::ptrdiff_t i = 0; i < _io_threads; ++i) {
+                threads.emplace_back(
+                        [this]() { guard([&]() { open_all(); }); });
+            }
+            if (tree_order::unordered == _order) {
+                for (std::ptrdiff_t i = 0; i < _workers; ++i) {
+                    threads.emplace_back(
+                            [this]() { guard([&]() { consume_ready(); }); });
+                }
+            } else {
+                guard([&]() { consume_in_order(); });
+            }
+            for (auto& t: threads) t.join();
+            if (_exception) std::rethrow_exception(_exception);
+        }
+
+    private:
+        struct tree_file {
+            std::string path;
+            std::promise<std::unique_ptr<istream>> opened;
+            std::future<std::unique_ptr<istream>> stream = opened.get_future();
+        };
+        using file_ptr = std::shared_ptr<tree_file>;
+
+        //Run f, and shut everything down if it throws.
+        template<typename F>
+        void guard(F f)
+        {
+            try {
+                f();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_exception) _exception = std::current_exception();
+                }
+                _failed = true;
+                _to_open.close();
+                _in_order.close();
+                _ready.close();
+            }
+        }
+
+        void walk_all(const std::string& root)
+        {
+            walk(root);
+            _to_open.close();
+            _in_order.close();
+        }
+
+        //Depth first, with each directory's entries sorted, so the order is
+        //the same from run to run. Symbolic links aren't followed.
+        bool walk(const std::string& dir)
+        {
+            std::vector<std::pair<std::string, bool>> entries;
+            {
+                std::unique_ptr<DIR, Closedir> d(opendir(dir.c_str()));
+                if (!d) throw std::system_error(errno, std::system_category());
+                while (auto entry = readdir(d.get())) {
+                    std::string name = entry->d_name;
+                    if ("." == name || ".." == name) continue;
+                    auto path = ('/' == dir.back())? dir + name:
+                        dir + '/' + name;
+                    auto type = entry->d_type;
+                    if (DT_UNKNOWN == type) {
+                        struct stat info;
+                        if (-1 == lstat(path.c_str(), &info)) {
+                            throw std::system_error(errno,
+                                    std::system_category());
+                        }
+                        type = S_ISDIR(info.st_mode)? DT_DIR:
+                            S_ISREG(info.st_mode)? DT_REG: DT_UNKNOWN;
+                    }
+                    if (DT_DIR == type) entries.emplace_back(path, true);
+                    else if (DT_REG == type) entries.emplace_back(path, false);
+                }
+            }
+            std::sort(entries.begin(), entries.end());
+            for (auto& entry: entries) {
+                if (entry.second) {
+                    if (!walk(entry.first)) return false;
+                    continue;
+                }
+                auto file = std::make_shared<tree_file>();
+                file->path = std::move(entry.first);
+                //Queue it to be opened first, so nothing ever waits on a
+                //file that won't be opened.
+                auto copy = file;
+                if (!_to_open.push(std::move(copy))) return false;
+                if (tree_order::ordered == _order) {
+                    if (!_in_order.push(std::move(file))) return false;
+                }
+            }
+            return true;
+        }
+
+        //Small files are read in whole here on the I/O thread, so the
+        //callback never waits on the disk. Bigger files are mapped.
+        static std::unique_ptr<istream> open(const std::string& path)
+        {
+            struct stat info;
+            if (-1 == stat(path.c_str(), &info)) {
+                throw std::system_error(errno, std::system_category());
+            }
+            if (info.st_size >= file_istream::mmap_threshold) {
+                return std::unique_ptr<istream>(new mmap_istream(path));
+            }
+            return std::unique_ptr<istream>(
+                    new vector_istream(read_all(path)));
+        }
+
+        void open_all()
+        {
+            while (auto file = _to_open.pop()) {
+                auto& f = **file;
+                if (tree_order::ordered == _order) {
+                    try {
+                        f.opened.set_value(open(f.path));
+                    } catch (...) {
+                        f.opened.set_exception(std::current_exception());
+                    }
+                } else {
+                    f.opened.set_value(open(f.path));
+                    if (!_ready.push(std::move(*file))) break;
+                }
+            }
+            if (0 == --_openers_left) _ready.close();
+        }
+
+        void consume_ready()
+        {
+            while (auto file = _ready.pop()) {
+                if (_failed) break;
+                auto stream = (*file)->stream.get();
+                _f((*file)->path, *stream);
+            }
+        }
+
+        void consume_in_order()
+        {
+            while (auto file = _in_order.pop()) {
+                if (_failed) break;
+                auto stream = (*file)->stream.get();
+                _f((*file)->path, *stream);
+            }
+        }
+
+        struct Closedir {
+            void operator()(DIR* d) { closedir(d); }
+        };
+
+        callback _f;
+        tree_order _order;
+        std::ptrdiff_t _workers;
+        std::ptrdiff_t _io_threads;
+        blocking_queue<file_ptr> _to_open;
+        blocking_queue<file_ptr> _in_order;
+        blocking_queue<file_ptr> _ready;
+        std::atomic<std::ptrdiff_t> _openers_left{0};
+        std::atomic<bool> _failed{false};
+        std::mutex _mutex;
+        std::exception_ptr _exception;
+    };
+
+    //read_tree
+    //Read every regular file under a directory, passing each one to a
+    //callback as an istream:
+    //
+    //  streams::read_tree("corpus",
+    //      [](const std::string& path, streams::istream& in) {
+    //          while (auto line = streams::get_line(in)) index(path, *line);
+    //      });
+    //
+    //Walking the tree, opening files, and reading small files into memory
+    //happen on I/O threads, up to `depth` files ahead of the callbacks.
+    //Files of file_istream::mmap_threshold bytes or more are mapped instead.
+    //
+    //With tree_order::unordered, the callback runs concurrently on `workers`
+    //threads (default: one per core). With tree_order::ordered, it runs on
+    //the calling thread, one file at a time, in sorted path order.
+    //
+    //The first exception from any thread, including the callback, stops the
+    //walk and is rethrown once all the threads have finished.
+    void read_tree(
+            const std::string& root,
+            tree_reader::callback f,
+            tree_order order = tree_order::unordered,
+            std::ptrdiff_t workers = 0,
+            std::ptrdiff_t io_threads = 2,
+            std::ptrdiff_t depth = 64)
+    {
+        if (workers <= 0) {
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        tree_reader reader(std::move(f), order, workers, io_threads, depth);
+        reader.run(root);
+    }
+}
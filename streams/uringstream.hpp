@@ -0,0 +1,390 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <gsl/gsl>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "istream.hpp"
+#include "filestream.hpp"
+
+namespace streams {
+    //uring
+    //A bare-bones io_uring submission/completion queue pair, driven through
+    //the raw system calls so there's no dependency on liburing.
+    //
+    //Not thread safe. Linux 5.6 or later.
+    class uring {
+    public:
+        explicit uring(unsigned entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof params);
+            _fd.reset(syscall(__NR_io_uring_setup, entries, &params));
+            if (-1 == _fd.get()) {
+                throw std::system_error(errno, std::system_category());
+            }
+
+            size_t sq_size =
+                params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            size_t cq_size =
+                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+            _sq_ring = map(sq_size, IORING_OFF_SQ_RING);
+            if (!single) _cq_ring = map(cq_size, IORING_OFF_CQ_RING);
+            auto cq = single? _sq_ring.data(): _cq_ring.data();
+            _sqe_ring = map(params.sq_entries * sizeof(io_uring_sqe),
+                    IORING_OFF_SQES);
+
+            auto sq = _sq_ring.data();
+            _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            _sq_mask = *reinterpret_cast<unsigned*>(
+                    sq + params.sq_off.ring_mask);
+            _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            _sq_entries = params.sq_entries;
+            _sqes = reinterpret_cast<io_uring_sqe*>(_sqe_ring.data());
+            _local_tail = *_sq_tail;
+
+            _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            _cq_mask = *reinterpret_cast<unsigned*>(
+                    cq + params.cq_off.ring_mask);
+            _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        }
+
+        uring(const uring&) = delete;
+        uring& operator=(const uring&) = delete;
+
+        //A zeroed submission queue entry to fill in.
+        //If the submission queue is full, what's in it is submitted first.
+        io_uring_sqe& next_sqe()
+        {
+            while (_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)
+                    >= _sq_entries) {
+                enter(0);
+            }
+            auto index = _local_tail & _sq_mask;
+            auto& sqe = _sqes[index];
+            std::memset(&sqe, 0, sizeof sqe);
+            _sq_array[index] = index;
+            ++_local_tail;
+            return sqe;
+        }
+
+        //Submit the queued entries and wait for at least min_complete
+        //completions.
+        void enter(unsigned min_complete)
+        {
+            auto to_submit = _local_tail - *_sq_tail;
+            __atomic_store_n(_sq_tail, _local_tail, __ATOMIC_RELEASE);
+            while (true) {
+                auto result = syscall(__NR_io_uring_enter, _fd.get(),
+                        to_submit, min_complete,
+                        min_complete? IORING_ENTER_GETEVENTS: 0, nullptr, 0);
+                if (-1 != result) break;
+                if (EINTR != errno) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                //The entries went in; only the wait was interrupted.
+                to_submit = 0;
+            }
+        }
+
+        //Call f(const io_uring_cqe&) for each waiting completion.
+        template<typename F>
+        void for_each_completion(F f)
+        {
+            auto head = *_cq_head;
+            while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+                auto cqe = _cqes[head & _cq_mask];
+                ++head;
+                __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+                f(cqe);
+            }
+        }
+
+    private:
+        //Map one of the ring's regions.
+        unique_mmap map(size_t size, off_t offset)
+        {
+            auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, _fd.get(), offset);
+            if (MAP_FAILED == p) {
+                throw std::system_error(errno, std::system_category());
+            }
+            return unique_mmap(p, size);
+        }
+
+        //Declared first, so the rings are unmapped before it's closed.
+        unique_fd _fd;
+        unique_mmap _sq_ring;
+        unique_mmap _cq_ring;
+        unique_mmap _sqe_ring;
+
+        unsigned* _sq_head;
+        unsigned* _sq_tail;
+        unsigned* _sq_array;
+        unsigned _sq_mask;
+        unsigned _sq_entries;
+        unsigned _local_tail;
+        io_uring_sqe* _sqes;
+
+        unsigned* _cq_head;
+        unsigned* _cq_tail;
+        unsigned _cq_mask;
+        io_uring_cqe* _cqes;
+    };
+
+    //uring_file_reader
+    //Reads whole files through io_uring. See read_files().
+    class uring_file_reader {
+    public:
+        using callback =
+            std::function<void(const std::string&, gsl::span<const gsl::byte>)>;
+
+        uring_file_reader(
+                const std::vector<std::string>& paths,
+                callback f,
+                std::ptrdiff_t concurrency):
+            _paths(paths),
+            _f(std::move(f)),
+            _ring(gsl::narrow<unsigned>(concurrency * 4)),
+            _slots(concurrency)
+        {
+            for (std::ptrdiff_t i = concurrency - 1; i >= 0; --i) {
+                _free.push_back(i);
+            }
+        }
+
+        void run()
+        {
+            std::ptrdiff_t next = 0;
+            std::ptrdiff_t paths = _paths.size();
+            while (true) {
+                while (!stopping() && !_free.empty() && next < paths) {
+                    start(next++);
+                }
+                if (_free.size() == _slots.size() && 0 == _closing) break;
+                _ring.enter(1);
+                _ring.for_each_completion([this](const io_uring_cqe& cqe) {
+                        //Carry on after an error, so no buffer is freed
+                        //while the kernel may still be reading into it.
+                        try { complete(cqe); }
+                        catch (...) { abandon(cqe); }
+                    });
+            }
+            if (_exception) std::rethrow_exception(_exception);
+            if (0 != _error) {
+                throw std::system_error(_error, std::system_category(),
+                        _error_path);
+            }
+        }
+
+    private:
+        enum op: std::uint64_t { op_open, op_statx, op_read, op_close };
+
+        struct file_slot {
+            std::ptrdiff_t index = -1;
+            int fd = -1;
+            int pending = 0;
+            int error = 0;
+            bool sized = false;
+            struct statx stx;
+            std::vector<gsl::byte> buffer;
+            std::ptrdiff_t filled = 0;
+        };
+
+        bool stopping() const { return _exception || 0 != _error; }
+
+        static std::uint64_t user_data(std::ptrdiff_t slot, op o)
+        { return (std::uint64_t(slot) << 2) | o; }
+
+        //Open and stat the file at the same time.
+        void start(std::ptrdiff_t index)
+        {
+            auto slot = _free.back();
+            _free.pop_back();
+            auto& s = _slots[slot];
+            s.index = index;
+            s.fd = -1;
+            s.pending = 2;
+            s.error = 0;
+            s.filled = 0;
+            const char* path = _paths[index].c_str();
+
+            auto& open_sqe = _ring.next_sqe();
+            open_sqe.opcode = IORING_OP_OPENAT;
+            open_sqe.fd = AT_FDCWD;
+            open_sqe.addr = reinterpret_cast<std::uint64_t>(path);
+            open_sqe.open_flags = O_RDONLY | O_CLOEXEC;
+            open_sqe.user_data = user_data(slot, op_open);
+
+            auto& statx_sqe = _ring.next_sqe();
+            statx_sqe.opcode = IORING_OP_STATX;
+            statx_sqe.fd = AT_FDCWD;
+            statx_sqe.addr = reinterpret_cast<std::uint64_t>(path);
+            statx_sqe.len = STATX_TYPE | STATX_SIZE;
+            statx_sqe.off = reinterpret_cast<std::uint64_t>(&s.stx);
+            statx_sqe.user_data = user_data(slot, op_statx);
+        }
+
+        void complete(const io_uring_cqe& cqe)
+        {
+            auto o = static_cast<op>(cqe.user_data & 3);
+            if (op_close == o) {
+                --_closing;
+                return;
+            }
+            auto slot = static_cast<std::ptrdiff_t>(cqe.user_data >> 2);
+            auto& s = _slots[slot];
+            --s.pending;
+            if (cqe.res < 0) s.error = -cqe.res;
+            else if (op_open == o) s.fd = cqe.res;
+            else if (op_read == o) s.filled += cqe.res;
+
+            if (0 != s.pending) return;
+            if (0 != s.error || stopping()) return finish(slot);
+            if (op_statx == o || op_open == o) {
+                //Size the buffer from statx. Files that don't know their
+                //size (like those in /proc) get a buffer that grows.
+                s.sized = S_ISREG(s.stx.stx_mode) && s.stx.stx_size > 0;
+                s.buffer.resize(s.sized? s.stx.stx_size: 64 * 1024);
+                return read_more(slot);
+            }
+            if (0 == cqe.res) return finish(slot);
+            if (s.sized && s.filled == std::ptrdiff_t(s.buffer.size())) {
+                return finish(slot);
+            }
+            if (s.filled == std::ptrdiff_t(s.buffer.size())) {
+                s.buffer.resize(s.buffer.size() * 2);
+            }
+            read_more(slot);
+        }
+
+        void read_more(std::ptrdiff_t slot)
+        {
+            auto& s = _slots[slot];
+            auto& read_sqe = _ring.next_sqe();
+            read_sqe.opcode = IORING_OP_READ;
+            read_sqe.fd = s.fd;
+            read_sqe.addr = reinterpret_cast<std::uint64_t>(
+                    s.buffer.data() + s.filled);
+            //A read can ask for at most 4GiB; short reads are continued.
+            read_sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(
+                        s.buffer.size() - s.filled, UINT32_MAX));
+            read_sqe.off = s.filled;
+            read_sqe.user_data = user_data(slot, op_read);
+            ++s.pending;
+        }
+
+        //complete() threw. Keep the error, and drop the file once nothing
+        //more is coming for it.
+        void abandon(const io_uring_cqe& cqe)
+        {
+            if (!_exception) _exception = std::current_exception();
+            if (op_close == static_cast<op>(cqe.user_data & 3)) return;
+            auto slot = static_cast<std::ptrdiff_t>(cqe.user_data >> 2);
+            auto& s = _slots[slot];
+            if (-1 != s.index && 0 == s.pending) finish(slot);
+        }
+
+        void finish(std::ptrdiff_t slot)
+        {
+            auto& s = _slots[slot];
+            const auto& path = _paths[s.index];
+            if (0 != s.error) {
+                if (!stopping()) {
+                    _error = s.error;
+                    _error_path = path;
+                }
+            } else if (!stopping()) {
+                try {
+                    _f(path, gsl::span<const gsl::byte>(s.buffer).first(
+                                s.filled));
+                } catch (...) {
+                    _exception = std::current_exception();
+                }
+            }
+            if (-1 != s.fd) {
+                auto& close_sqe = _ring.next_sqe();
+                close_sqe.opcode = IORING_OP_CLOSE;
+                close_sqe.fd = s.fd;
+                close_sqe.user_data = user_data(slot, op_close);
+                ++_closing;
+            }
+            s.index = -1;
+            _free.push_back(slot);
+        }
+
+        const std::vector<std::string>& _paths;
+        callback _f;
+        uring _ring;
+        std::vector<file_slot> _slots;
+        std::vector<std::ptrdiff_t> _free;
+        std::ptrdiff_t _closing = 0;
+        int _error = 0;
+        std::string _error_path;
+        std::exception_ptr _exception;
+    };
+
+    //read_files
+    //Read many whole files, handing each one to a callback:
+    //
+    //  streams::read_files(paths,
+    //      [](const std::string& path, gsl::span<const gsl::byte> data) {
+    //          streams::span_istream in(data);
+    //          ...
+    //      });
+    //
+    //The openat, statx, read, and close for up to `concurrency` files at a
+    //time are queued through io_uring, so reading lots of small files costs
+    //a few io_uring_enter() calls instead of four system calls per file.
+    //The data passed to the callback is only valid during the call.
+    //Callbacks are made from the calling thread, in completion order.
+    //
+    //If a file can't be read, or the callback throws, the files already in
+    //flight are finished without calling the callback and the error is
+    //thrown. Where io_uring isn't available, files are read one at a time
+    //with read_all().
+    void read_files(
+            const std::vector<std::string>& paths,
+            uring_file_reader::callback f,
+            std::ptrdiff_t concurrency = 64)
+    {
+        Expects(concurrency > 0);
+        std::unique_ptr<uring_file_reader> reader;
+        try {
+            reader.reset(new uring_file_reader(paths, f, concurrency));
+        } catch (const std::system_error& e) {
+            //io_uring_setup() fails like this where io_uring isn't available.
+            if (ENOSYS != e.code().value() && EPERM != e.code().value()) {
+                throw;
+            }
+        }
+        if (reader) {
+            reader->run();
+            return;
+        }
+        for (const auto& path: paths) {
+            auto data = read_all(path);
+            f(path, data);
+        }
+    }
+}
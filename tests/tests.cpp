@@ -1,6 +1,15 @@
 #define CATCH_CONFIG_MAIN
 #include <cstdint>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <thread>
 #include <vector>
 #include <catch.hpp>
 #include <gsl/gsl>
@@ -8,11 +17,42 @@
 #include "streams/ostream.hpp"
 #include "streams/istream.hpp"
 #include "streams/mmapstream.hpp"
+#include "streams/filestream.hpp"
+#include "streams/reversestream.hpp"
+#include "streams/followstream.hpp"
+#include "streams/uringstream.hpp"
+#include "streams/treestream.hpp"
+#include "streams/copy.hpp"
+#include "streams/handle.hpp"
+#include "streams/ranges.hpp"
+#include "streams/generatorstream.hpp"
+#include "streams/pipeline.hpp"
+#include "streams/processstream.hpp"
+#include "streams/splicestream.hpp"
+#include "streams/socketstream.hpp"
 
 namespace {
     template<typename T>
     gsl::span<const gsl::byte> to_byte_span(const T& t)
     { return gsl::as_bytes(gsl::span<const T>(&t, 1)); }
+
+#if defined(__cpp_impl_coroutine)
+    streams::byte_generator count_lines(int n)
+    {
+        for (int i = 1; i <= n; ++i) {
+            auto line = std::to_string(i) + '\n';
+            co_yield gsl::as_bytes(gsl::span<const char>(line));
+            //Nothing yielded.
+            co_yield gsl::span<const gsl::byte>();
+        }
+    }
+
+    streams::byte_generator fail_after(std::int32_t n)
+    {
+        co_yield to_byte_span(n);
+        throw std::runtime_error("generator failed");
+    }
+#endif
 }
 
 TEST_CASE("streams", "[streams]")
@@ -38,6 +78,62 @@ TEST_CASE("streams", "[streams]")
         REQUIRE(control == data);
     }
 
+    SECTION("chained_span_ostream") {
+        std::vector<gsl::byte> data(control.size());
+        gsl::span<gsl::byte> whole(data);
+        //Slots that don't line up with the values written into them.
+        gsl::span<gsl::byte> slots[] = {
+            whole.first(2), whole.subspan(2, 4), whole.subspan(6, 0),
+            whole.subspan(6) };
+        {
+            streams::chained_span_ostream stream(slots);
+            REQUIRE(stream.extents() == 0);
+            stream.put<std::int8_t>(0x01);
+            stream.put<std::int16_t>(0x0202);
+            REQUIRE(stream.extents() == 2);
+            REQUIRE(stream.extent(1).size() == 1);
+            stream.put<std::int32_t>(0x03030303);
+            stream.put<std::int64_t>(0x0404040404040404);
+            REQUIRE(control == data);
+            REQUIRE(stream.extents() == 4);
+            REQUIRE(stream.extent(3).size() == 9);
+            REQUIRE(stream.size() == std::ptrdiff_t(control.size()));
+            REQUIRE(stream.write(control) == 0);
+        }
+        //Fixed-size slots, handed off and refilled as they fill up.
+        std::array<gsl::byte, 4> slot;
+        gsl::span<gsl::byte> list[] = { slot };
+        std::vector<gsl::byte> sent;
+        auto hand_off = [&]() {
+            sent.insert(sent.end(), slot.begin(), slot.end());
+            return streams::chained_span_ostream::span_list(list);
+        };
+        streams::chained_span_ostream stream(list, hand_off);
+        REQUIRE(stream.write(control) == std::ptrdiff_t(control.size()));
+        auto space = stream.reserve(4);
+        REQUIRE(space.size() == 0);
+        space = stream.reserve(1);
+        REQUIRE(space.size() == 1);
+        stream.commit(1);
+        REQUIRE(sent.size() == 12);
+        REQUIRE(stream.extents() == 1);
+        REQUIRE(stream.extent(0).size() == 4);
+        REQUIRE(stream.size() == 16);
+        sent.insert(sent.end(), slot.begin(), slot.begin() + 3);
+        REQUIRE(control == sent);
+
+        //A callback that only has empty spans to give ends the output.
+        std::array<gsl::span<gsl::byte>, 2> empties;
+        int asked = 0;
+        streams::chained_span_ostream starved(empties, [&]() {
+                ++asked;
+                return streams::chained_span_ostream::span_list(empties);
+            });
+        REQUIRE(starved.write(control) == 0);
+        REQUIRE(starved.reserve(1).size() == 0);
+        REQUIRE(asked == 2);
+    }
+
     SECTION("vector_ostream") {
         streams::vector_ostream stream;
         stream.put<std::int8_t>(0x01);
@@ -48,6 +144,41 @@ TEST_CASE("streams", "[streams]")
         REQUIRE(control == data);
     }
 
+    SECTION("small_ostream") {
+        streams::small_ostream<16> stream;
+        stream.put<std::int8_t>(0x01);
+        stream.put<std::int16_t>(0x0202);
+        stream.put<std::int32_t>(0x03030303);
+        stream.put<std::int64_t>(0x0404040404040404);
+        REQUIRE(!stream.spilled());
+        auto view = stream.view();
+        REQUIRE(control == std::vector<gsl::byte>(view.begin(), view.end()));
+        //Spill into a chunk, then into a bigger one.
+        stream.write(control);
+        stream.write(std::vector<gsl::byte>(40, gsl::byte('x')));
+        REQUIRE(stream.spilled());
+        REQUIRE(stream.size() == 70);
+        std::ptrdiff_t segments = 0;
+        stream.for_each_segment(
+                [&](gsl::span<const gsl::byte>) { ++segments; });
+        REQUIRE(segments == 3);
+        auto expected = control;
+        expected.insert(expected.end(), control.begin(), control.end());
+        expected.insert(expected.end(), 40, gsl::byte('x'));
+        view = stream.view();
+        REQUIRE(expected == std::vector<gsl::byte>(view.begin(), view.end()));
+        streams::vector_ostream vos;
+        stream.write_to(vos);
+        REQUIRE(expected == vos.vector());
+        stream.clear();
+        REQUIRE(!stream.spilled());
+        streams::print(stream, "{}-{}", "small", 42);
+        auto space = stream.reserve(2);
+        space[0] = gsl::byte('!');
+        stream.commit(1);
+        REQUIRE(stream.str() == "small-42!");
+    }
+
     SECTION("buf_ostream") {
         streams::vector_ostream vos;
         {
@@ -58,6 +189,112 @@ TEST_CASE("streams", "[streams]")
         REQUIRE(control == data);
     }
 
+    SECTION("batch_writer") {
+        struct Counting_ostream: public streams::ostream {
+            streams::vector_ostream _sink;
+            int _writes = 0;
+            std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+            {
+                ++_writes;
+                return _sink.write(bytes);
+            }
+        };
+        Counting_ostream stream;
+        {
+            streams::batch_writer<16> batch(stream);
+            batch.put<std::int8_t>(0x01);
+            batch.put<std::int16_t>(0x0202);
+            batch.put<std::int32_t>(0x03030303);
+            batch.put<std::int64_t>(0x0404040404040404);
+            REQUIRE(0 == stream._writes);
+            batch.commit();
+            REQUIRE(1 == stream._writes);
+            REQUIRE(control == stream._sink.vector());
+            //Bigger than the batch: staged bytes, then the big write.
+            batch.put<std::int8_t>(0x01);
+            std::vector<gsl::byte> big(100);
+            batch.write(big);
+            REQUIRE(3 == stream._writes);
+            batch.put<std::int8_t>(0x01);
+        }
+        REQUIRE(4 == stream._writes);
+        REQUIRE(stream._sink.vector().size() == control.size() + 102);
+    }
+
+    SECTION("reserve/commit") {
+        std::vector<gsl::byte> data(control.size());
+        streams::span_ostream sos(data);
+        streams::vector_ostream vos;
+        streams::vector_ostream sink;
+        streams::buf_ostream bos(sink, 8);
+        for (streams::ostream* out: std::initializer_list<streams::ostream*>{
+                &sos, &vos, &bos }) {
+            auto space = out->reserve(3);
+            REQUIRE(space.size() == 3);
+            space[0] = gsl::byte(0x01);
+            space[1] = gsl::byte(0x02);
+            out->commit(2);
+            //Committing less than was reserved.
+            space = out->reserve(5);
+            REQUIRE(space.size() == 5);
+            space[0] = gsl::byte(0x02);
+            out->commit(1);
+            streams::batch_writer<8> batch(*out);
+            batch.put<std::int32_t>(0x03030303);
+            batch.put<std::int64_t>(0x0404040404040404);
+        }
+        bos.flush();
+        REQUIRE(control == data);
+        REQUIRE(control == vos.vector());
+        REQUIRE(control == sink.vector());
+        //buf_ostream can't reserve more than its buffer.
+        REQUIRE(bos.reserve(9).size() == 0);
+        REQUIRE(sos.reserve(1).size() == 0);
+        streams::stdio_ostream unbuffered(stdout);
+        REQUIRE(unbuffered.reserve(1).size() == 0);
+    }
+
+    SECTION("reserve without commit") {
+        //Space that's reserved but never committed isn't output.
+        const std::string fname("reserve_test.txt");
+        streams::vector_ostream vos;
+        streams::vector_ostream sink;
+        {
+            streams::buf_ostream bos(sink, 8);
+            streams::file_ostream fos(fname);
+            std::initializer_list<streams::ostream*> outs{ &vos, &bos, &fos };
+            for (auto out: outs) {
+                auto space = out->reserve(4);
+                REQUIRE(space.size() == 4);
+                std::fill(space.begin(), space.end(), gsl::byte('x'));
+                streams::put_string(*out, "ok");
+                out->flush();
+                REQUIRE(out->reserve(8).size() == 8);
+                //Only what's committed.
+                out->commit(0);
+                out->reserve(1)[0] = gsl::byte('!');
+                out->commit(1);
+            }
+            REQUIRE(fos.tell() == 3);
+            REQUIRE(vos.vector().size() == 3);
+        }
+        auto ok = [](const std::vector<gsl::byte>& v) {
+            return std::string(reinterpret_cast<const char*>(v.data()),
+                    v.size()) == "ok!";
+        };
+        REQUIRE(ok(vos.vector()));
+        REQUIRE(ok(sink.vector()));
+        REQUIRE(ok(streams::read_all(fname)));
+        std::remove(fname.c_str());
+
+        //vector_ostream's space is in the vector itself, not a copy.
+        streams::vector_ostream in_place;
+        auto room = in_place.reserve(4);
+        in_place.commit(4);
+        REQUIRE(in_place.vector().data() == room.data());
+        REQUIRE(4 == in_place.vector().size());
+    }
+
     //streams::print
     SECTION("print") {
         std::vector<gsl::byte> control;
@@ -128,6 +365,734 @@ TEST_CASE("streams", "[streams]")
         REQUIRE(*n64 == 0x0404040404040404);
     }
 
+    SECTION("movable streams") {
+        const std::string fname("movable_test.txt");
+        std::vector<streams::posix_file_ostream> files;
+        files.emplace_back(fname);
+        //Grow the vector, moving the stream.
+        files.reserve(files.capacity() + 1);
+        streams::put_string(files.front(), "moved");
+        files.clear();
+        std::vector<streams::posix_file_istream> ins;
+        ins.emplace_back(fname);
+        ins.reserve(ins.capacity() + 1);
+        REQUIRE(*streams::get_line(ins.front()) == "moved");
+
+        //Streams holding a unique_fd pass it on, rather than both closing
+        //it.
+        std::vector<streams::posix_direct_istream> directs;
+        directs.emplace_back(fname);
+        std::vector<streams::follow_istream> follows;
+        follows.emplace_back(fname, 0);
+        directs.reserve(directs.capacity() + 1);
+        follows.reserve(follows.capacity() + 1);
+        {
+            //Would get an fd a moved-from stream closed by mistake.
+            streams::posix_file_istream other(fname);
+            directs.clear();
+            follows.clear();
+            REQUIRE(-1 != fcntl(other.fd(), F_GETFD));
+            REQUIRE(*streams::get_line(other) == "moved");
+        }
+        streams::mapped_file mapped(fname);
+        streams::mapped_file moved(std::move(mapped));
+        REQUIRE(0 == mapped.bytes().size());
+        REQUIRE(5 == moved.bytes().size());
+        REQUIRE('m' == char(moved.bytes()[0]));
+
+        std::vector<gsl::byte> v(control);
+        streams::vector_istream vis(v);
+        REQUIRE(*vis.get<std::int8_t>() == 0x01);
+        streams::vector_istream vis2(std::move(vis));
+        REQUIRE(!vis.get<std::int8_t>());
+        REQUIRE(*vis2.get<std::int16_t>() == 0x0202);
+        std::remove(fname.c_str());
+    }
+
+    SECTION("stream_handle") {
+        const std::string fname("handle_test.txt");
+        std::vector<gsl::byte> data(4);
+        std::vector<streams::ostream_handle<>> outs;
+        outs.emplace_back(streams::vector_ostream());
+        outs.emplace_back(streams::span_ostream(data));
+        outs.emplace_back(streams::posix_file_ostream(fname));
+        outs.emplace_back();
+        //Move them all around.
+        outs.reserve(outs.capacity() + 1);
+        std::swap(outs[0], outs[3]);
+        REQUIRE(!outs[0]);
+        outs.erase(outs.begin());
+        for (auto& out: outs) out->put<std::int32_t>(0x03030303);
+        auto& vos = static_cast<streams::vector_ostream&>(*outs[2]);
+        REQUIRE(vos.vector().size() == 4);
+        REQUIRE(data == vos.vector());
+        outs.clear();
+
+        streams::istream_handle<> in;
+        in.emplace<streams::posix_file_istream>(fname);
+        auto moved = std::move(in);
+        REQUIRE(!in);
+        REQUIRE(*moved->get<std::int32_t>() == 0x03030303);
+        moved = streams::span_istream(control);
+        REQUIRE(*moved->get<std::int8_t>() == 0x01);
+        std::remove(fname.c_str());
+    }
+
+    SECTION("lines") {
+        std::string text("one\n\nthree\nfour, with no newline");
+        std::vector<gsl::byte> bytes(text.size());
+        std::copy_n(reinterpret_cast<const gsl::byte*>(text.data()),
+                text.size(), bytes.begin());
+        std::vector<std::string> expected{
+            "one", "", "three", "four, with no newline" };
+        //A tiny buffer, so lines cross refills and the buffer has to grow.
+        for (std::ptrdiff_t size: { 4, 64 * 1024 }) {
+            streams::span_istream in(bytes);
+            std::vector<std::string> got;
+            for (auto line: streams::lines(in, '\n', size)) {
+                got.emplace_back(line.begin(), line.end());
+            }
+            REQUIRE(expected == got);
+        }
+        bytes.push_back(gsl::byte('\n'));
+        streams::span_istream in(bytes);
+        auto range = streams::lines(in);
+        REQUIRE(std::count_if(range.begin(), range.end(),
+                    [](streams::string_view line) { return line.empty(); })
+                == 1);
+        streams::span_istream empty(gsl::span<const gsl::byte>{});
+        auto none = streams::lines(empty);
+        REQUIRE(none.begin() == none.end());
+    }
+
+    SECTION("records") {
+        std::vector<std::int32_t> numbers(1000);
+        std::iota(numbers.begin(), numbers.end(), -500);
+        streams::vector_ostream out;
+        for (auto n: numbers) out.put(n);
+        //Plus a partial record, which is ignored.
+        out.put<std::int16_t>(7);
+        for (std::ptrdiff_t size: { 6, 64 * 1024 }) {
+            streams::span_istream in(out.vector());
+            auto range = streams::records<std::int32_t>(in, size);
+            std::vector<std::int32_t> got(range.begin(), range.end());
+            REQUIRE(numbers == got);
+        }
+        streams::span_istream in(out.vector());
+        auto range = streams::records<std::int32_t>(in);
+        REQUIRE(std::accumulate(range.begin(), range.end(), 0) == -500);
+    }
+
+    SECTION("chunks") {
+        streams::span_istream in(control);
+        std::vector<std::ptrdiff_t> sizes;
+        std::vector<gsl::byte> joined;
+        for (auto chunk: streams::chunks(in, 4, 10)) {
+            sizes.push_back(chunk.size());
+            joined.insert(joined.end(), chunk.begin(), chunk.end());
+        }
+        REQUIRE(sizes == (std::vector<std::ptrdiff_t>{ 4, 4, 4, 3 }));
+        REQUIRE(control == joined);
+    }
+
+#if defined(__cpp_impl_coroutine)
+    SECTION("generator_istream") {
+        streams::generator_istream in(count_lines(100));
+        int expected = 0;
+        for (auto line: streams::lines(in, '\n', 4)) {
+            REQUIRE(std::string(line.begin(), line.end()) ==
+                    std::to_string(++expected));
+        }
+        REQUIRE(expected == 100);
+
+        streams::generator_istream spans(count_lines(3));
+        REQUIRE(spans.next().size() == 2);
+        REQUIRE(*spans.get<char>() == '2');
+        REQUIRE(spans.next().size() == 1);
+        REQUIRE(spans.next().size() == 2);
+        REQUIRE(spans.next().size() == 0);
+
+        streams::generator_istream failing(fail_after(42));
+        REQUIRE(*failing.get<std::int32_t>() == 42);
+        REQUIRE_THROWS_AS(failing.get<char>(), std::runtime_error);
+    }
+
+#endif
+    SECTION("spsc_queue") {
+        streams::spsc_queue<int> queue(4);
+        std::thread producer([&]() {
+                for (int i = 0; i < 100000; ++i) queue.push(std::move(i));
+                queue.close();
+            });
+        int expected = 0;
+        bool in_order = true;
+        while (auto i = queue.pop()) in_order = in_order && *i == expected++;
+        producer.join();
+        REQUIRE(in_order);
+        REQUIRE(expected == 100000);
+        int refused = 1;
+        REQUIRE(!queue.push(std::move(refused)));
+    }
+
+    SECTION("spsc_queue in an event loop") {
+        //No spinning, so the consumer really waits on its fd.
+        streams::spsc_queue<int> queue(4, 0);
+        REQUIRE(!queue.try_pop());
+        pollfd p{ queue.consumer_fd(), POLLIN, 0 };
+        REQUIRE(0 == poll(&p, 1, 0));
+        int first = 1;
+        REQUIRE(queue.try_push(std::move(first)));
+        REQUIRE(1 == poll(&p, 1, 0));
+        REQUIRE(1 == *queue.try_pop());
+
+        queue.close();
+        REQUIRE(!queue.try_pop());
+        REQUIRE(1 == poll(&p, 1, 0));
+
+        //Short runs, so close() often lands while the consumer is between
+        //checking and parking. It must still wake up.
+        bool in_order = true;
+        bool woke = true;
+        for (int round = 0; round < 500 && woke; ++round) {
+            streams::spsc_queue<int> q(4, 0);
+            std::thread producer([&]() {
+                    for (int i = 0; i < 50; ++i) q.push(std::move(i));
+                    q.close();
+                });
+            int expected = 0;
+            while (true) {
+                //If it was closed before try_pop(), empty means finished.
+                bool closed = q.closed();
+                if (auto i = q.try_pop()) {
+                    in_order = in_order && *i == expected++;
+                } else if (closed) {
+                    break;
+                } else {
+                    pollfd wait{ q.consumer_fd(), POLLIN, 0 };
+                    if (0 == poll(&wait, 1, 5000)) {
+                        woke = false;
+                        break;
+                    }
+                }
+            }
+            producer.join();
+            in_order = in_order && expected == 50;
+        }
+        REQUIRE(woke);
+        REQUIRE(in_order);
+    }
+
+    SECTION("pipeline") {
+        streams::vector_ostream source;
+        std::string expected;
+        for (int i = 0; i < 5000; ++i) {
+            auto line = fmt::format("line {}\n", i);
+            streams::put_string(source, line);
+            for (auto& c: line) c = std::toupper(c);
+            expected += line + line;
+        }
+        auto upper = [](gsl::span<const gsl::byte> in, streams::ostream& out) {
+            auto space = out.reserve(in.size());
+            std::transform(in.begin(), in.end(), space.begin(),
+                    [](gsl::byte b) {
+                        return gsl::byte(std::toupper(int(b)));
+                    });
+            out.commit(in.size());
+        };
+        //Needs whole lines.
+        auto twice = [](gsl::span<const gsl::byte> in, streams::ostream& out) {
+            streams::span_istream lines_in(in);
+            for (auto line: streams::lines(lines_in)) {
+                for (int i = 0; i < 2; ++i) {
+                    out.write(gsl::as_bytes(gsl::span<const char>(
+                                    line.data(), line.size())));
+                    streams::put_char(out, '\n');
+                }
+            }
+        };
+        streams::pipeline_options options;
+        options.chunk_size = 100;
+        options.queue_depth = 2;
+        options.delimiter = gsl::byte('\n');
+        for (std::ptrdiff_t parallelism: { 1, 3 }) {
+            streams::span_istream in(source.vector());
+            streams::vector_ostream sink;
+            streams::pipeline p(in, options);
+            p.then("upper", upper, parallelism)
+             .then("twice", twice, parallelism + 1)
+             .run(sink);
+            REQUIRE(std::string(reinterpret_cast<const char*>(
+                            sink.vector().data()), sink.vector().size())
+                    == expected);
+            auto& metrics = p.metrics();
+            REQUIRE(metrics.size() == 2);
+            REQUIRE(metrics[0].name == "upper");
+            REQUIRE(metrics[0].bytes_in ==
+                    std::ptrdiff_t(source.vector().size()));
+            REQUIRE(metrics[0].bytes_out == metrics[1].bytes_in);
+            REQUIRE(metrics[1].bytes_out == 2 * metrics[1].bytes_in);
+            REQUIRE(metrics[0].chunks == metrics[1].chunks);
+            REQUIRE(metrics[0].chunks > 100);
+        }
+
+        streams::span_istream in(source.vector());
+        streams::vector_ostream sink;
+        streams::pipeline failing(in, options);
+        std::atomic<int> calls{0};
+        failing.then("fail", [&](gsl::span<const gsl::byte>, streams::ostream&) {
+                    if (10 == ++calls) throw std::runtime_error("stage failed");
+                }, 2);
+        REQUIRE_THROWS_AS(failing.run(sink), std::runtime_error);
+    }
+
+    SECTION("parallel_ostream") {
+        std::string text;
+        for (int i = 0; i < 5000; ++i) text += fmt::format("line {}\n", i);
+        std::string expected(text);
+        for (auto& c: expected) c = std::toupper(c);
+        //Uneven work, so batches finish out of order.
+        std::atomic<int> calls{0};
+        auto shout = [&](gsl::span<const gsl::byte> in, streams::ostream& out) {
+            if (0 == ++calls % 3) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            for (auto b: in) out.put(char(std::toupper(int(b))));
+        };
+        auto as_string = [](const std::vector<gsl::byte>& v) {
+            return std::string(reinterpret_cast<const char*>(v.data()),
+                    v.size());
+        };
+        streams::parallel_options options;
+        options.workers = 4;
+        options.batch_size = 64;
+        options.max_in_flight = 6;
+        {
+            streams::vector_ostream sink;
+            {
+                streams::parallel_ostream out(sink, shout, options);
+                //Writes both smaller and larger than a batch.
+                streams::put_string(out, text.substr(0, 10));
+                streams::put_string(out, text.substr(10, 1000));
+                streams::put_string(out, text.substr(1010));
+                out.flush();
+                REQUIRE(as_string(sink.vector()) == expected);
+                streams::put_string(out, "more");
+            }
+            REQUIRE(as_string(sink.vector()) == expected + "MORE");
+        }
+
+        //Whole lines only.
+        options.delimiter = gsl::byte('\n');
+        streams::span_istream in(gsl::as_bytes(gsl::span<const char>(text)));
+        streams::vector_ostream sink;
+        std::atomic<bool> whole_lines{true};
+        streams::parallel_transform(in, sink,
+                [&](gsl::span<const gsl::byte> in, streams::ostream& out) {
+                    if (gsl::byte('\n') != in[in.size() - 1]) {
+                        whole_lines = false;
+                    }
+                    shout(in, out);
+                }, options);
+        REQUIRE(whole_lines);
+        REQUIRE(as_string(sink.vector()) == expected);
+
+        streams::vector_ostream unused;
+        streams::parallel_ostream failing(unused,
+                [](gsl::span<const gsl::byte>, streams::ostream&) {
+                    throw std::runtime_error("transform failed");
+                }, options);
+        //The first batch to fail may already be reported by write().
+        auto write_all = [&]() {
+            streams::put_string(failing, text);
+            failing.flush();
+        };
+        REQUIRE_THROWS_AS(write_all(), std::runtime_error);
+    }
+
+    SECTION("subprocess") {
+        streams::subprocess ok({ "true" });
+        REQUIRE(ok.wait() == 0);
+        streams::subprocess failed({ "sh", "-c", "exit 3" });
+        REQUIRE(failed.wait() == 3);
+        REQUIRE(failed.wait() == 3);
+        REQUIRE_THROWS_AS(streams::subprocess({ "no-such-command-here" }),
+                std::system_error);
+    }
+
+    SECTION("make_pipe") {
+        auto ends = streams::make_pipe(256 * 1024);
+        REQUIRE(fcntl(ends.second.fd(), F_GETPIPE_SZ) >= 256 * 1024);
+        streams::put_string(ends.second, "through the pipe");
+        ends.second.flush();
+        ends.second.close();
+        REQUIRE(*streams::get_line(ends.first) == "through the pipe");
+        REQUIRE(!streams::get_line(ends.first));
+    }
+
+    SECTION("process_chain") {
+        const std::string fname("process_chain_test.txt");
+        std::string text;
+        for (int i = 0; i < 100; ++i) text += fmt::format("line {}\n", i);
+        std::string expected;
+        for (int i = 0; i < 100; ++i) {
+            expected += fmt::format("> LINE {}\n", i);
+        }
+        auto as_string = [](const std::vector<gsl::byte>& v) {
+            return std::string(reinterpret_cast<const char*>(v.data()),
+                    v.size());
+        };
+        std::vector<std::vector<std::string>> commands{
+            { "sed", "s/^/> /" }, { "tr", "a-z", "A-Z" } };
+        {
+            streams::process_chain chain(commands);
+            REQUIRE(fcntl(chain.input().fd(), F_GETPIPE_SZ) == 1024 * 1024);
+            streams::put_string(chain.input(), text);
+            chain.input().close();
+            REQUIRE(as_string(streams::read_all(chain.output())) == expected);
+            REQUIRE(chain.wait() == (std::vector<int>{ 0, 0 }));
+        }
+        {
+            //From a file, spliced in.
+            {
+                streams::posix_file_ostream out(fname);
+                streams::put_string(out, text);
+            }
+            streams::posix_file_istream in(fname);
+            streams::process_chain chain(commands);
+            std::thread writer([&]() {
+                    streams::copy(in, chain.input());
+                    chain.input().close();
+                });
+            auto result = streams::read_all(chain.output());
+            writer.join();
+            REQUIRE(as_string(result) == expected);
+        }
+        {
+            //The file as the first command's input.
+            streams::posix_file_istream in(fname);
+            streams::process_chain chain(commands, in.fd());
+            REQUIRE(as_string(streams::read_all(chain.output())) == expected);
+        }
+        streams::process_chain failing(
+                { { "sh", "-c", "exit 2" }, { "cat" } }, -1);
+        REQUIRE(failing.wait() == (std::vector<int>{ 2, 0 }));
+
+        //Commands that exit without reading their input are an EPIPE
+        //exception, not a SIGPIPE that kills us.
+        std::string big(1024 * 1024, 'x');
+        auto epipe = [](std::function<void()> f) {
+            try { f(); }
+            catch (const std::system_error& e) {
+                return EPIPE == e.code().value();
+            }
+            return false;
+        };
+        streams::process_chain early({ { "sh", "-c", "exit 5" } });
+        REQUIRE(epipe([&]() {
+                    for (int i = 0; i < 4; ++i) {
+                        streams::put_string(early.input(), big);
+                    }
+                }));
+        REQUIRE(early.wait() == std::vector<int>{ 5 });
+        streams::process_chain early_copy({ { "true" } });
+        streams::posix_file_istream zeros("/dev/zero");
+        REQUIRE(epipe([&]() { streams::copy(zeros, early_copy.input()); }));
+        REQUIRE(early_copy.wait() == std::vector<int>{ 0 });
+        std::remove(fname.c_str());
+    }
+
+    SECTION("process_pool_ostream") {
+        std::string text;
+        for (int i = 0; i < 5000; ++i) text += fmt::format("line {}\n", i);
+        text += "no newline";
+        std::string expected(text);
+        for (auto& c: expected) c = std::toupper(c);
+        auto as_string = [](const std::vector<gsl::byte>& v) {
+            return std::string(reinterpret_cast<const char*>(v.data()),
+                    v.size());
+        };
+        streams::process_pool_options options;
+        options.processes = 3;
+        options.chunk_size = 100;
+        for (auto dispatch: { streams::process_dispatch::round_robin,
+                streams::process_dispatch::least_loaded }) {
+            options.dispatch = dispatch;
+            streams::vector_ostream sink;
+            {
+                streams::process_pool_ostream out(
+                        sink, { "tr", "a-z", "A-Z" }, options);
+                streams::put_string(out, text.substr(0, 1000));
+                out.flush();
+                streams::put_string(out, text.substr(1000));
+                out.close();
+            }
+            REQUIRE(as_string(sink.vector()) == expected);
+        }
+
+        //flush() can come while the readers are writing to the sink.
+        struct Watching_ostream: public streams::ostream {
+            streams::vector_ostream _sink;
+            std::atomic<bool> _busy{false};
+            std::atomic<bool> _overlapped{false};
+            void enter()
+            {
+                if (_busy.exchange(true)) _overlapped = true;
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            std::ptrdiff_t _write(gsl::span<const gsl::byte> bytes) override
+            {
+                enter();
+                auto n = _sink.write(bytes);
+                _busy = false;
+                return n;
+            }
+            void _flush() override
+            {
+                enter();
+                _busy = false;
+            }
+        };
+        Watching_ostream watched;
+        {
+            streams::process_pool_ostream out(watched, { "cat" }, options);
+            for (std::size_t i = 0; i < text.size(); i += 500) {
+                streams::put_string(out, text.substr(i, 500));
+                out.flush();
+            }
+            out.close();
+        }
+        REQUIRE(!watched._overlapped);
+        REQUIRE(as_string(watched._sink.vector()) == text);
+
+        streams::vector_ostream sink;
+        //Output without input to go with it is an error.
+        std::string extra;
+        try {
+            streams::process_pool_ostream doubled(sink, { "sed", "p" });
+            streams::put_string(doubled, text);
+            doubled.close();
+        } catch (const std::runtime_error& e) {
+            extra = e.what();
+        }
+        REQUIRE(extra == "process_pool_ostream: command "
+                "wrote more records than it read");
+
+        streams::process_pool_ostream failing(sink,
+                { "sh", "-c", "cat > /dev/null; exit 3" }, options);
+        streams::put_string(failing, text);
+        REQUIRE_THROWS_AS(failing.close(), std::runtime_error);
+
+        //A process that stops reading is an exception, not a SIGPIPE.
+        std::string message;
+        try {
+            streams::process_pool_ostream early(sink,
+                    { "sh", "-c", "exit 4" }, options);
+            for (int i = 0; i < 1000; ++i) {
+                streams::put_string(early, text);
+                early.flush();
+            }
+            early.close();
+        } catch (const std::runtime_error& e) {
+            message = e.what();
+        }
+        REQUIRE(message ==
+                "process_pool_ostream: command exited with status 4");
+
+        REQUIRE_THROWS_AS(streams::process_pool_ostream(sink,
+                    { "no-such-command-for-streams-tests" }, options),
+                std::system_error);
+    }
+
+    SECTION("vmsplice_ostream") {
+        std::vector<gsl::byte> big(1024 * 1024);
+        for (std::size_t i = 0; i < big.size(); ++i) {
+            big[i] = gsl::byte(i * 7 % 251);
+        }
+        auto ends = streams::make_pipe();
+        std::vector<gsl::byte> received;
+        std::thread reader([&]() {
+                received = streams::read_all(ends.first); });
+        {
+            streams::vmsplice_ostream out(ends.second.fd());
+            streams::vector_ostream results;
+            results.write(big);
+            out.give(results);
+            REQUIRE(results.vector().empty());
+            out.put(gsl::byte(1));
+            streams::span_istream sis(big);
+            out.lend(sis.next());
+            REQUIRE(sis.next().size() == 0);
+            out.drain();
+            REQUIRE(0 == out.held());
+        }
+        ends.second.close();
+        reader.join();
+        std::vector<gsl::byte> expected(big);
+        expected.push_back(gsl::byte(1));
+        expected.insert(expected.end(), big.begin(), big.end());
+        REQUIRE(received == expected);
+
+        //With the reader gone, it's EPIPE, not SIGPIPE.
+        auto closed = streams::make_pipe();
+        closed.first.close();
+        {
+            streams::vmsplice_ostream out(closed.second.fd());
+            auto epipe = [](std::function<void()> f) {
+                try { f(); }
+                catch (const std::system_error& e) {
+                    return EPIPE == e.code().value();
+                }
+                return false;
+            };
+            REQUIRE(epipe([&]() { out.give(big); }));
+            REQUIRE(epipe([&]() { out.lend(big); }));
+            REQUIRE(epipe([&]() { out.put(gsl::byte(1)); }));
+        }
+
+        //Not a pipe, so everything is copied.
+        const std::string fname("vmsplice_ostream_test.bin");
+        {
+            streams::posix_file_ostream file(fname);
+            streams::vmsplice_ostream out(file.fd());
+            out.give(big);
+            REQUIRE(0 == out.held());
+            out.lend(big);
+        }
+        streams::posix_file_istream in(fname);
+        auto both = streams::read_all(in);
+        REQUIRE(both.size() == 2 * big.size());
+        REQUIRE(std::equal(big.begin(), big.end(), both.begin()));
+        std::remove(fname.c_str());
+    }
+
+    SECTION("tcp streams") {
+        streams::tcp_listener listener;
+        REQUIRE(listener.port() > 0);
+        auto client = streams::tcp_connect("127.0.0.1", listener.port());
+        auto server = listener.accept();
+
+        std::vector<gsl::byte> big(1024 * 1024);
+        for (std::size_t i = 0; i < big.size(); ++i) {
+            big[i] = gsl::byte(i * 13 % 251);
+        }
+        std::vector<gsl::byte> expected;
+        std::ptrdiff_t gathered = 0;
+        std::ptrdiff_t held = -1;
+        std::thread writer([&]() {
+                streams::tcp_ostream out(client.fd(), 64 * 1024);
+                client.set_nodelay(true);
+                streams::put_string(out, "hello ");
+                std::string a("gathered "), b("in one "), c("call");
+                gsl::span<const gsl::byte> spans[] = {
+                    gsl::as_bytes(gsl::span<const char>(a)),
+                    gsl::as_bytes(gsl::span<const char>(b)),
+                    gsl::as_bytes(gsl::span<const char>(c)) };
+                gathered = out.write_gather(spans);
+                out.give(big);
+                out.give(std::vector<gsl::byte>(10, gsl::byte('z')));
+                out.flush();
+                held = out.held();
+                client.shutdown_write();
+            });
+        std::string text("hello gathered in one call");
+        expected.assign(reinterpret_cast<const gsl::byte*>(text.data()),
+                reinterpret_cast<const gsl::byte*>(text.data()) + text.size());
+        expected.insert(expected.end(), big.begin(), big.end());
+        expected.insert(expected.end(), 10, gsl::byte('z'));
+
+        //No REQUIRE until the writer's joined: a failure would destroy a
+        //joinable thread.
+        streams::tcp_istream in(server.fd());
+        std::vector<gsl::byte> received(6);
+        auto first = in.read(received).size();
+        std::vector<gsl::byte> some(64 * 1024);
+        auto n = in.receive(some).size();
+        received.insert(received.end(), some.begin(), some.begin() + n);
+        auto rest = streams::read_all(in);
+        received.insert(received.end(), rest.begin(), rest.end());
+        writer.join();
+        REQUIRE(6 == first);
+        REQUIRE(n > 0);
+        REQUIRE(20 == gathered);
+        REQUIRE(0 == held);
+        REQUIRE(received == expected);
+
+        //A corked write waits for flush(). The kernel lets it go by itself
+        //after 200ms, so only look 50ms ahead.
+        server.set_cork(true);
+        streams::tcp_ostream reply(server.fd());
+        streams::put_string(reply, "corked");
+        pollfd p{ client.fd(), POLLIN, 0 };
+        REQUIRE(0 == poll(&p, 1, 50));
+        reply.flush();
+        REQUIRE(1 == poll(&p, 1, 50));
+        streams::tcp_istream back(client.fd());
+        std::vector<gsl::byte> word(6);
+        REQUIRE(back.read(word).size() == 6);
+        REQUIRE(std::string(reinterpret_cast<const char*>(word.data()), 6)
+                == "corked");
+
+        //receive() goes on past 64 spans while there's more queued.
+        server.set_cork(false);
+        std::vector<gsl::byte> letters(100);
+        for (std::size_t i = 0; i < letters.size(); ++i) {
+            letters[i] = gsl::byte('a' + i % 26);
+        }
+        reply.write(letters);
+        //Wait until all of it is queued.
+        std::vector<gsl::byte> peeked(letters.size());
+        REQUIRE(100 == recv(client.fd(), peeked.data(), peeked.size(),
+                    MSG_PEEK | MSG_WAITALL));
+        std::vector<gsl::byte> scattered(letters.size());
+        std::vector<gsl::span<gsl::byte>> spans;
+        for (auto& b: scattered) spans.push_back(gsl::span<gsl::byte>(&b, 1));
+        REQUIRE(100 == back.receive(spans));
+        REQUIRE(scattered == letters);
+        server.shutdown_write();
+        REQUIRE(0 == back.receive(word).size());
+    }
+
+    SECTION("read_scatter") {
+        const std::string fname("read_scatter_test.bin");
+        {
+            streams::posix_file_ostream out(fname);
+            out.write(control);
+        }
+        streams::span_istream sis(control);
+        streams::span_istream buffered_source(control);
+        streams::buf_istream bis(buffered_source, 4);
+        streams::posix_file_istream pis(fname);
+        for (streams::istream* in: std::initializer_list<streams::istream*>{
+                &sis, &bis, &pis }) {
+            std::int8_t n8;
+            std::int16_t n16;
+            std::vector<gsl::byte> rest(control.size());
+            auto bytes = in->read_scatter({
+                    gsl::as_writeable_bytes(gsl::span<std::int8_t>(&n8, 1)),
+                    gsl::as_writeable_bytes(gsl::span<std::int16_t>(&n16, 1)),
+                    rest });
+            REQUIRE(bytes == std::ptrdiff_t(control.size()));
+            REQUIRE(n8 == 0x01);
+            REQUIRE(n16 == 0x0202);
+            rest.resize(control.size() - 3);
+            REQUIRE(std::equal(rest.begin(), rest.end(),
+                        control.begin() + 3));
+            REQUIRE(!in->get<gsl::byte>());
+        }
+
+        //What's left over refills the buf_istream's buffer.
+        streams::span_istream source(control);
+        streams::buf_istream in(source, 8);
+        std::int8_t n8;
+        std::int16_t n16;
+        REQUIRE(3 == in.read_scatter({
+                    gsl::as_writeable_bytes(gsl::span<std::int8_t>(&n8, 1)),
+                    gsl::as_writeable_bytes(gsl::span<std::int16_t>(&n16, 1))
+                    }));
+        REQUIRE(*in.get<std::int32_t>() == 0x03030303);
+        REQUIRE(*in.get<std::int64_t>() == 0x0404040404040404);
+    }
+
     SECTION("unget_istream") {
         streams::span_istream sis(
                 gsl::span<const gsl::byte>(control.data(), control.size()));
@@ -250,13 +1215,11 @@ TEST_CASE("streams", "[streams]")
     }
 
     SECTION("mmap_*stream") {
-        //Only mmap_isteram implemented so far.
-        //So, we'll sub use stdio_file_ostream for mmap_ostream.
         const std::string fname("mmap_file_test.txt");
         std::time_t t(std::time(nullptr));
         std::string date = fmt::format("{:%Y-%b-%d %T}", *std::localtime(&t));
         {
-            streams::stdio_file_ostream out(fname);
+            streams::mmap_ostream out(fname);
             streams::put_string(out, date);
         }
         {
@@ -265,5 +1228,375 @@ TEST_CASE("streams", "[streams]")
             REQUIRE(*line == date);
         }
     }
-}
 
+    SECTION("mmap_options") {
+        const std::string fname("mmap_options_test.txt");
+        std::string text;
+        for (int i = 0; i < 100000; ++i) text += fmt::format("line {}\n", i);
+        {
+            streams::file_ostream out(fname);
+            streams::put_string(out, text);
+        }
+        streams::mmap_options populate;
+        populate.populate = true;
+        populate.huge_pages = true;
+        streams::mmap_options ahead;
+        ahead.willneed_window = 64 * 1024;
+        ahead.prefault_distance = 256 * 1024;
+        //Not a whole number of pages.
+        streams::mmap_options uneven;
+        uneven.willneed_window = 10000;
+        for (auto options: { populate, ahead, uneven }) {
+            streams::mmap_istream in(fname, options);
+            std::string contents;
+            while (auto line = streams::get_line(in)) contents += *line + '\n';
+            REQUIRE(contents == text);
+        }
+        //Destroyed while the prefault thread is still running.
+        streams::mmap_istream in(fname, ahead);
+    }
+
+    SECTION("mmap_ostream writeback") {
+        const std::string fname("mmap_writeback_test.bin");
+        std::vector<gsl::byte> block(10000);
+        std::vector<gsl::byte> control;
+        {
+            streams::mmap_ostream out(fname, 64 * 1024);
+            for (int i = 0; i < 300; ++i) {
+                std::fill(block.begin(), block.end(), gsl::byte(i));
+                out.write(block);
+                control.insert(control.end(), block.begin(), block.end());
+                if (100 == i) out.flush();
+            }
+            auto space = out.reserve(4);
+            REQUIRE(space.size() == 4);
+            std::fill(space.begin(), space.end(), gsl::byte('x'));
+            out.commit(4);
+            control.insert(control.end(), 4, gsl::byte('x'));
+            out.sync_range(0, out.size() / 2,
+                    streams::mmap_ostream::sync_mode::async);
+            out.sync_range(out.size() / 2, out.size());
+            REQUIRE(out.size() == 3000004);
+        }
+        REQUIRE(streams::read_all(fname) == control);
+    }
+
+    SECTION("file_istream") {
+        const std::string fname("file_istream_test.txt");
+        std::string text;
+        for (int i = 0; i < 10000; ++i) text += fmt::format("line {}\n", i);
+        {
+            streams::posix_file_ostream out(fname);
+            streams::put_string(out, text);
+        }
+        REQUIRE(streams::file_istream::choose(fname) ==
+                streams::file_access::mmap);
+        REQUIRE(streams::file_istream::choose("/proc/self/status") ==
+                streams::file_access::buffered);
+        for (auto access: {
+                streams::file_access::automatic,
+                streams::file_access::buffered,
+                streams::file_access::mmap,
+                streams::file_access::direct }) {
+            streams::file_istream in(fname, access);
+            std::string contents(text.size() + 1, '\0');
+            auto bytes = in.read(gsl::as_writeable_bytes(
+                        gsl::span<char>(&contents[0], contents.size())));
+            REQUIRE(bytes.size() == std::ptrdiff_t(text.size()));
+            contents.resize(bytes.size());
+            REQUIRE(contents == text);
+        }
+        {
+            streams::file_istream in("/proc/self/status");
+            auto line = streams::get_line(in);
+            REQUIRE(line->substr(0, 5) == "Name:");
+        }
+    }
+
+    SECTION("file_ostream") {
+        const std::string fname("file_ostream_test.txt");
+        std::vector<gsl::byte> big(100000, gsl::byte('x'));
+        {
+            streams::file_ostream out(fname, false, 16);
+            out.preallocate(big.size());
+            streams::put_string(out, "*****");
+            out.write(big);
+            streams::put_line(out, "tail");
+            REQUIRE(out.tell() == 5 + 100000 + 5);
+            out.seek(0, streams::seekable::seek_origin::set);
+            streams::put_string(out, "head:");
+        }
+        streams::file_istream in(fname);
+        auto line = streams::get_line(in);
+        REQUIRE(line->size() == 5 + 100000 + 4);
+        REQUIRE(line->substr(0, 5) == "head:");
+        REQUIRE(line->substr(5 + 100000) == "tail");
+        REQUIRE(!streams::get_line(in));
+    }
+
+    SECTION("read_all") {
+        const std::string fname("read_all_test.txt");
+        std::string text;
+        for (int i = 0; i < 20000; ++i) text += fmt::format("line {}\n", i);
+        {
+            streams::file_ostream out(fname);
+            streams::put_string(out, text);
+        }
+        auto to_string = [](gsl::span<const gsl::byte> bytes) {
+            return std::string(reinterpret_cast<const char*>(bytes.data()),
+                    bytes.size());
+        };
+        REQUIRE(to_string(streams::read_all(fname)) == text);
+        {
+            streams::stdio_pipe_istream in(fmt::format("cat {}", fname));
+            REQUIRE(to_string(streams::read_all(in)) == text);
+        }
+        {
+            streams::span_istream in(gsl::as_bytes(
+                        gsl::span<const char>(text.data(), text.size())));
+            REQUIRE(to_string(streams::read_all(in, text.size())) == text);
+        }
+        REQUIRE(to_string(streams::read_all("/proc/self/status"))
+                .substr(0, 5) == "Name:");
+        streams::mapped_file mapped(fname);
+        REQUIRE(to_string(mapped.bytes()) == text);
+    }
+
+    SECTION("reverse_*") {
+        const std::string fname("reverse_test.txt");
+        std::string text;
+        for (int i = 0; i < 2000; ++i) text += fmt::format("line {}\n", i);
+        {
+            streams::file_ostream out(fname);
+            streams::put_string(out, text);
+        }
+        {
+            streams::reverse_istream in(fname, 4096);
+            std::string contents(text.size(), '\0');
+            auto bytes = in.read(gsl::as_writeable_bytes(
+                        gsl::span<char>(&contents[0], contents.size())));
+            REQUIRE(bytes.size() == std::ptrdiff_t(text.size()));
+            REQUIRE(std::string(text.rbegin(), text.rend()) == contents);
+        }
+        {
+            int i = 2000;
+            for (const auto& line: streams::reverse_lines(fname, '\n', 4096)) {
+                REQUIRE(line == fmt::format("line {}", --i));
+            }
+            REQUIRE(0 == i);
+        }
+        {
+            {
+                streams::file_ostream out(fname);
+                streams::put_string(out, "a\n\nb");
+            }
+            streams::reverse_lines lines(fname);
+            REQUIRE(*lines.next() == "b");
+            REQUIRE(*lines.next() == "");
+            REQUIRE(*lines.next() == "a");
+            REQUIRE(!lines.next());
+        }
+    }
+
+    SECTION("follow_istream") {
+        const std::string fname("follow_test.txt");
+        {
+            streams::file_ostream out(fname);
+            streams::put_line(out, "first");
+        }
+        streams::follow_istream in(fname, 5000);
+        REQUIRE(*streams::get_line(in) == "first");
+
+        //Appended while we're blocked.
+        std::thread writer([&fname]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            streams::file_ostream out(fname, true);
+            streams::put_line(out, "appended");
+        });
+        REQUIRE(*streams::get_line(in) == "appended");
+        writer.join();
+
+        //Truncated.
+        {
+            streams::file_ostream out(fname);
+            streams::put_line(out, "short");
+        }
+        REQUIRE(*streams::get_line(in) == "short");
+
+        //Rotated.
+        REQUIRE(0 == std::rename(fname.c_str(), (fname + ".1").c_str()));
+        {
+            streams::file_ostream out(fname);
+            streams::put_line(out, "rotated");
+        }
+        REQUIRE(*streams::get_line(in) == "rotated");
+
+        streams::follow_istream quiet(fname, 10);
+        REQUIRE(*streams::get_line(quiet) == "rotated");
+        REQUIRE(!streams::get_line(quiet));
+
+        //Other files coming and going in the directory don't hold off the
+        //timeout. (The noise stops by itself, in case they do.)
+        std::atomic<bool> stop{false};
+        std::thread noise([&stop]() {
+            auto end = std::chrono::steady_clock::now()
+                + std::chrono::seconds(3);
+            for (int i = 0; !stop && std::chrono::steady_clock::now() < end;
+                    ++i) {
+                auto name = fmt::format("follow_noise_{}.txt", i % 4);
+                { streams::file_ostream out(name); }
+                std::remove(name.c_str());
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+        streams::follow_istream busy(fname, 200);
+        REQUIRE(*streams::get_line(busy) == "rotated");
+        auto start = std::chrono::steady_clock::now();
+        bool timed_out = !streams::get_line(busy);
+        auto waited = std::chrono::steady_clock::now() - start;
+        stop = true;
+        noise.join();
+        REQUIRE(timed_out);
+        REQUIRE(waited < std::chrono::seconds(2));
+    }
+
+    SECTION("read_files") {
+        std::vector<std::string> paths;
+        for (int i = 0; i < 200; ++i) {
+            paths.push_back(fmt::format("read_files_test_{}.txt", i));
+            streams::file_ostream out(paths.back());
+            for (int j = 0; j < i * 10; ++j) streams::print(out, "{} ", i);
+        }
+        paths.push_back("/proc/self/status");
+        std::map<std::string, std::string> contents;
+        streams::read_files(paths,
+                [&contents](const std::string& path,
+                    gsl::span<const gsl::byte> data) {
+                    contents[path].assign(
+                            reinterpret_cast<const char*>(data.data()),
+                            data.size());
+                }, 8);
+        REQUIRE(contents.size() == paths.size());
+        for (int i = 0; i < 200; ++i) {
+            std::string expected;
+            for (int j = 0; j < i * 10; ++j) expected += fmt::format("{} ", i);
+            REQUIRE(contents[paths[i]] == expected);
+        }
+        REQUIRE(contents["/proc/self/status"].substr(0, 5) == "Name:");
+
+        paths.push_back("no_such_file.txt");
+        REQUIRE_THROWS_AS(streams::read_files(paths,
+                    [](const std::string&, gsl::span<const gsl::byte>) {}),
+                std::system_error);
+    }
+
+    SECTION("read_tree") {
+        const std::string root("read_tree_test");
+        std::vector<std::string> paths;
+        for (auto dir: { root, root + "/a", root + "/b", root + "/b/c" }) {
+            mkdir(dir.c_str(), 0755);
+            for (int i = 0; i < 5; ++i) {
+                paths.push_back(fmt::format("{}/{}.txt", dir, i));
+                streams::file_ostream out(paths.back());
+                //One file big enough to be mapped.
+                int lines = ("read_tree_test/b/3.txt" == paths.back())?
+                    10000: 3;
+                for (int j = 0; j < lines; ++j) {
+                    streams::put_line(out, paths.back());
+                }
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+
+        std::vector<std::string> seen;
+        streams::read_tree(root,
+                [&seen](const std::string& path, streams::istream& in) {
+                    REQUIRE(*streams::get_line(in) == path);
+                    seen.push_back(path);
+                }, streams::tree_order::ordered);
+        REQUIRE(seen == paths);
+
+        std::mutex m;
+        std::map<std::string, int> counts;
+        streams::read_tree(root,
+                [&](const std::string& path, streams::istream& in) {
+                    int lines = 0;
+                    while (auto line = streams::get_line(in)) {
+                        if (*line != path) break;
+                        ++lines;
+                    }
+                    std::lock_guard<std::mutex> lock(m);
+                    counts[path] = lines;
+                }, streams::tree_order::unordered, 4);
+        REQUIRE(counts.size() == paths.size());
+        REQUIRE(counts["read_tree_test/b/3.txt"] == 10000);
+        REQUIRE(counts["read_tree_test/a/1.txt"] == 3);
+
+        REQUIRE_THROWS_AS(streams::read_tree(root,
+                    [](const std::string&, streams::istream&) {
+                        throw std::runtime_error("callback failed");
+                    }), std::runtime_error);
+        REQUIRE_THROWS_AS(streams::read_tree("no_such_dir",
+                    [](const std::string&, streams::istream&) {}),
+                std::system_error);
+    }
+
+    SECTION("copy") {
+        const std::string from("copy_test_from.bin");
+        const std::string to("copy_test_to.bin");
+        const std::ptrdiff_t gap = 16 * 1024 * 1024;
+        {
+            streams::posix_file_ostream out(from);
+            streams::put_string(out, "head");
+            out.seek(gap, streams::seekable::seek_origin::cur);
+            streams::put_string(out, "middle");
+            out.seek(gap, streams::seekable::seek_origin::cur);
+            streams::put_string(out, "tail");
+            //Leave a hole at the end, too.
+            REQUIRE(0 == ftruncate(out.fd(), out.tell() + gap));
+        }
+        auto size = 4 + gap + 6 + gap + 4 + gap;
+        REQUIRE(streams::copy_file(from, to) == size);
+        REQUIRE(streams::read_all(to) == streams::read_all(from));
+        struct stat info;
+        REQUIRE(0 == stat(to.c_str(), &info));
+        REQUIRE(info.st_size == size);
+        //Only the blocks holding data were allocated.
+        REQUIRE(info.st_blocks * 512 < gap);
+
+        int fds[2];
+        REQUIRE(0 == pipe(fds));
+        const std::string text("through a pipe");
+        REQUIRE(write(fds[1], text.data(), text.size()) ==
+                std::ptrdiff_t(text.size()));
+        close(fds[1]);
+        {
+            streams::posix_fd_istream in(fds[0]);
+            streams::posix_file_ostream out(to);
+            REQUIRE(streams::copy(in, out) == std::ptrdiff_t(text.size()));
+        }
+        close(fds[0]);
+        streams::posix_file_istream in(to);
+        REQUIRE(*streams::get_line(in) == text);
+
+        //Appending takes neither copy_file_range() nor a splice() out of
+        //the pipe, but only finds that out after splicing in. What's in
+        //the pipe still gets written.
+        std::vector<gsl::byte> dense(300 * 1024);
+        for (std::size_t i = 0; i < dense.size(); ++i) {
+            dense[i] = gsl::byte(i * 7 % 251);
+        }
+        {
+            streams::posix_file_ostream out(from);
+            out.write(dense);
+        }
+        std::remove(to.c_str());
+        {
+            streams::posix_file_istream dense_in(from);
+            streams::posix_file_ostream out(to, true);
+            REQUIRE(streams::copy(dense_in, out) ==
+                    std::ptrdiff_t(dense.size()));
+        }
+        REQUIRE(streams::read_all(to) == dense);
+    }
+}